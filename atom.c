@@ -18,79 +18,302 @@
 
 #include "cvs.h"
 #include <stdint.h>
+#include <pthread.h>
+
+/*
+ * The atom table is split into shards, each with its own lock, picked
+ * by the top bits of the hash so that loader threads rarely meet.
+ * Each shard chains entries off a power-of-two bucket array which
+ * doubles once it holds as many strings as buckets. Strings are
+ * carved from large blocks and never move, so atoms stay valid
+ * while the table grows.
+ */
 
 typedef uint32_t	crc32_t;
 
-static crc32_t crc32_table[256];
+#define ATOM_SHARD_BITS		6
+#define ATOM_SHARDS		(1 << ATOM_SHARD_BITS)
+#define ATOM_MIN_BUCKETS	256
+#define ATOM_BLOCK		(64 * 1024)
+
+typedef struct _hash_bucket {
+    struct _hash_bucket	*next;
+    crc32_t		crc;
+    uint32_t		len;
+    char		string[0];
+} hash_bucket_t;
+
+typedef struct _atom_block {
+    struct _atom_block	*next;
+    char		data[0];
+} atom_block;
+
+typedef struct _atom_shard {
+    pthread_mutex_t	mutex;
+    hash_bucket_t	**buckets;
+    unsigned long	nbuckets;
+    unsigned long	count;
+    atom_block		*blocks;
+    char		*free;
+    size_t		nfree;
+    size_t		bytes;
+    unsigned long	lookups;
+    unsigned long	probes;
+} atom_shard;
+
+static atom_shard	shards[ATOM_SHARDS];
+static pthread_once_t	atom_once = PTHREAD_ONCE_INIT;
+
+/*
+ * CRC32C (Castagnoli polynomial), eight bytes at a time: with the
+ * SSE4.2 crc32 instruction where the cpu has it, otherwise with
+ * slice-by-8 tables
+ */
+static crc32_t crc32c_table[8][256];
 
 static void
-generate_crc32_table(void)
+generate_crc32c_table (void)
 {
-    crc32_t	c, p;
+    crc32_t	c;
     int		n, m;
 
-    p = 0xedb88320;
-    for (n = 0; n < 256; n++)
-    {
+    for (n = 0; n < 256; n++) {
 	c = n;
 	for (m = 0; m < 8; m++)
-	    c = (c >> 1) ^ ((c & 1) ? p : 0);
-	crc32_table[n] = c;
+	    c = (c >> 1) ^ ((c & 1) ? 0x82f63b78 : 0);
+	crc32c_table[0][n] = c;
+    }
+    for (n = 0; n < 256; n++) {
+	c = crc32c_table[0][n];
+	for (m = 1; m < 8; m++) {
+	    c = (c >> 8) ^ crc32c_table[0][c & 0xff];
+	    crc32c_table[m][n] = c;
+	}
     }
 }
 
 static crc32_t
-crc32 (char *string)
+crc32c_table8 (crc32_t crc, char *string, size_t len)
 {
-    crc32_t		crc32 = ~0;
-    unsigned char	c;
+    unsigned char   *p = (unsigned char *) string;
 
-    if (crc32_table[1] == 0) generate_crc32_table ();
-    while ((c = (unsigned char) *string++))
-	crc32 = (crc32 >> 8) ^ crc32_table[(crc32 ^ c) & 0xff];
-    return ~crc32;
+    while (len >= 8) {
+	crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((crc32_t) p[3] << 24);
+	crc = crc32c_table[7][crc & 0xff] ^
+	      crc32c_table[6][(crc >> 8) & 0xff] ^
+	      crc32c_table[5][(crc >> 16) & 0xff] ^
+	      crc32c_table[4][crc >> 24] ^
+	      crc32c_table[3][p[4]] ^
+	      crc32c_table[2][p[5]] ^
+	      crc32c_table[1][p[6]] ^
+	      crc32c_table[0][p[7]];
+	p += 8;
+	len -= 8;
+    }
+    while (len--)
+	crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    return crc;
 }
 
-#define HASH_SIZE	9013
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
 
-typedef struct _hash_bucket {
-    struct _hash_bucket	*next;
-    crc32_t		crc;
-    char		string[0];
-} hash_bucket_t;
+__attribute__ ((target ("sse4.2")))
+static crc32_t
+crc32c_sse42 (crc32_t crc, char *string, size_t len)
+{
+    uint64_t	c = crc, w;
 
-static hash_bucket_t	*buckets[HASH_SIZE];
+    while (len >= 8) {
+	memcpy (&w, string, 8);
+	c = _mm_crc32_u64 (c, w);
+	string += 8;
+	len -= 8;
+    }
+    crc = c;
+    while (len--)
+	crc = _mm_crc32_u8 (crc, *string++);
+    return crc;
+}
+#endif
+
+static crc32_t	(*crc32c) (crc32_t crc, char *string, size_t len);
+
+static void
+atom_init (void)
+{
+    int	i;
+
+    for (i = 0; i < ATOM_SHARDS; i++)
+	pthread_mutex_init (&shards[i].mutex, NULL);
+    generate_crc32c_table ();
+    crc32c = crc32c_table8;
+#ifdef HAVE_CRC32C_SSE42
+    if (__builtin_cpu_supports ("sse4.2"))
+	crc32c = crc32c_sse42;
+#endif
+}
 
+static void
+atom_grow (atom_shard *s)
+{
+    unsigned long   nbuckets = s->nbuckets ? s->nbuckets * 2 : ATOM_MIN_BUCKETS;
+    hash_bucket_t   **buckets = calloc (nbuckets, sizeof (hash_bucket_t *));
+    hash_bucket_t   *b, *next;
+    unsigned long   i;
+
+    for (i = 0; i < s->nbuckets; i++)
+	for (b = s->buckets[i]; b; b = next) {
+	    next = b->next;
+	    b->next = buckets[b->crc & (nbuckets - 1)];
+	    buckets[b->crc & (nbuckets - 1)] = b;
+	}
+    free (s->buckets);
+    s->buckets = buckets;
+    s->nbuckets = nbuckets;
+}
+
+/*
+ * Long strings get a block of their own rather than
+ * wasting the tail of the current one
+ */
+static hash_bucket_t *
+atom_alloc (atom_shard *s, size_t len)
+{
+    size_t	size = (sizeof (hash_bucket_t) + len + 1 + sizeof (void *) - 1) &
+		       ~(sizeof (void *) - 1);
+    atom_block	*k;
+    char	*p;
+
+    if (size > s->nfree) {
+	if (size > ATOM_BLOCK / 4) {
+	    k = malloc (sizeof (atom_block) + size);
+	    k->next = s->blocks;
+	    s->blocks = k;
+	    return (hash_bucket_t *) k->data;
+	}
+	k = malloc (sizeof (atom_block) + ATOM_BLOCK);
+	k->next = s->blocks;
+	s->blocks = k;
+	s->free = k->data;
+	s->nfree = ATOM_BLOCK;
+    }
+    p = s->free;
+    s->free += size;
+    s->nfree -= size;
+    return (hash_bucket_t *) p;
+}
+
+/*
+ * Intern len bytes of string, which need not be nul terminated
+ */
 char *
-atom (char *string)
+atom_n (char *string, size_t len)
 {
-    crc32_t		crc = crc32 (string);
-    hash_bucket_t	**head = &buckets[crc % HASH_SIZE];
+    crc32_t		crc;
+    atom_shard		*s;
+    hash_bucket_t	**head;
     hash_bucket_t	*b;
-    int			len = strlen (string);
 
-    while ((b = *head)) {
-	if (b->crc == crc && !strcmp (string, b->string))
-	    return b->string;
-	head = &(b->next);
+    pthread_once (&atom_once, atom_init);
+    crc = ~crc32c (~0, string, len);
+    s = &shards[crc >> (32 - ATOM_SHARD_BITS)];
+    pthread_mutex_lock (&s->mutex);
+    s->lookups++;
+    if (s->nbuckets) {
+	for (b = s->buckets[crc & (s->nbuckets - 1)]; b; b = b->next) {
+	    s->probes++;
+	    if (b->crc == crc && b->len == len &&
+		!memcmp (string, b->string, len))
+		goto done;
+	}
     }
-    b = malloc (sizeof (hash_bucket_t) + len + 1);
-    b->next = 0;
+    if (s->count >= s->nbuckets)
+	atom_grow (s);
+    b = atom_alloc (s, len);
     b->crc = crc;
-    memcpy (b->string, string, len + 1);
+    b->len = len;
+    memcpy (b->string, string, len);
+    b->string[len] = '\0';
+    head = &s->buckets[crc & (s->nbuckets - 1)];
+    b->next = *head;
     *head = b;
+    s->count++;
+    s->bytes += len + 1;
+done:
+    pthread_mutex_unlock (&s->mutex);
     return b->string;
 }
 
+char *
+atom (char *string)
+{
+    return atom_n (string, strlen (string));
+}
+
+void
+atom_stats (FILE *f)
+{
+    unsigned long   count = 0, nbuckets = 0, lookups = 0, probes = 0;
+    unsigned long   nblocks = 0, longest = 0, chain, i;
+    size_t	    bytes = 0;
+    atom_shard	    *s;
+    atom_block	    *k;
+    hash_bucket_t   *b;
+    int		    n;
+
+    pthread_once (&atom_once, atom_init);
+    for (n = 0; n < ATOM_SHARDS; n++) {
+	s = &shards[n];
+	pthread_mutex_lock (&s->mutex);
+	count += s->count;
+	nbuckets += s->nbuckets;
+	lookups += s->lookups;
+	probes += s->probes;
+	bytes += s->bytes;
+	for (k = s->blocks; k; k = k->next)
+	    nblocks++;
+	for (i = 0; i < s->nbuckets; i++) {
+	    chain = 0;
+	    for (b = s->buckets[i]; b; b = b->next)
+		chain++;
+	    if (chain > longest)
+		longest = chain;
+	}
+	pthread_mutex_unlock (&s->mutex);
+    }
+    fprintf (f, "Atoms: %lu strings, %lu bytes in %lu blocks\n",
+	     count, (unsigned long) bytes, nblocks);
+    fprintf (f, "Atoms: %d shards, %lu buckets, load %.2f, longest chain %lu\n",
+	     ATOM_SHARDS, nbuckets,
+	     nbuckets ? (double) count / nbuckets : 0.0, longest);
+    fprintf (f, "Atoms: %lu lookups, %.2f probes per lookup, %s crc32c\n",
+	     lookups, lookups ? (double) probes / lookups : 0.0,
+	     crc32c == crc32c_table8 ? "table" : "sse4.2");
+}
+
 void
 discard_atoms (void)
 {
-    hash_bucket_t	**head, *b;
-    int			i;
+    atom_shard	*s;
+    atom_block	*k;
+    int		n;
 
-    for (i = 0; i < HASH_SIZE; i++)
-	for (head = &buckets[i]; (b = *head);) {
-	    *head = b->next;
-	    free (b);
+    for (n = 0; n < ATOM_SHARDS; n++) {
+	s = &shards[n];
+	pthread_mutex_lock (&s->mutex);
+	while ((k = s->blocks)) {
+	    s->blocks = k->next;
+	    free (k);
 	}
+	free (s->buckets);
+	s->buckets = NULL;
+	s->nbuckets = 0;
+	s->count = 0;
+	s->free = NULL;
+	s->nfree = 0;
+	s->bytes = 0;
+	pthread_mutex_unlock (&s->mutex);
+    }
 }
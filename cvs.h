@@ -48,9 +48,9 @@ typedef struct _cvs_number {
 struct _cvs_version;
 struct _cvs_patch;
 struct _rev_file;
+struct _rev_commit;
 
 typedef struct node {
-	struct node *hash_next;
 	cvs_number number;
 	struct _cvs_version *v;
 	struct _cvs_patch *p;
@@ -59,7 +59,10 @@ typedef struct node {
 	struct node *down;
 	struct node *sib;
 	struct _rev_file *file;
+	struct _rev_commit *commit;	/* set by rev_list_cvs */
+	struct _rev_commit *graft;	/* where a branch from here joins */
 	int starts;
+	int branched;			/* listed in some version's branches */
 } Node;
 
 typedef struct _cvs_symbol {
@@ -87,11 +90,34 @@ typedef struct _cvs_version {
     Node		*node;
 } cvs_version;
 
+/*
+ * Raw contents of a ,v file; either mapped or read into memory.
+ * *end is always a readable '\0'
+ */
+typedef struct _cvs_input {
+    char		*name;
+    char		*base;
+    char		*ptr;		/* next byte for the lexer */
+    char		*end;
+    size_t		mapped;		/* length of mapping, 0 if read */
+    int			stream;		/* drop pages once they are used */
+} cvs_input;
+
+/*
+ * Delta text as found in the ,v file, from the opening '@' through
+ * the closing '@', with '@@' escapes left in place. Points into the
+ * cvs_input the file was parsed from.
+ */
+typedef struct _cvs_text {
+    char		*text;
+    size_t		length;
+} cvs_text;
+
 typedef struct _cvs_patch {
     struct _cvs_patch	*next;
     cvs_number		number;
     char		*log;
-    char		*text;
+    cvs_text		text;
     Node		*node;
 } cvs_patch;
 
@@ -108,6 +134,51 @@ typedef struct {
     char 		*expand;
 } cvs_file;
 
+/*
+ * Storage for the cvs_file, its versions, patches, symbols and
+ * branches and the Nodes built over them. None of it outlives
+ * the conversion of the file, so it is all released at once
+ */
+typedef struct _cvs_arena_block {
+    struct _cvs_arena_block *next;
+    double		data[0];
+} cvs_arena_block;
+
+typedef struct _cvs_arena {
+    cvs_arena_block	*blocks;
+    char		*free;
+    size_t		nfree;
+    size_t		size;		/* next block size */
+} cvs_arena;
+
+/*
+ * Revisions of a single ,v file indexed by number; rcs2git walks
+ * the tree built from this
+ */
+typedef struct _node_hash {
+    Node		**table;
+    int			size;		/* power of two */
+    int			entries;
+    Node		*head_node;
+    cvs_arena		*arena;		/* where Nodes are allocated */
+} node_hash;
+
+/*
+ * Everything needed to turn one ,v file into a rev_list. Nothing
+ * in here is shared, so separate files may be converted at the
+ * same time using separate contexts
+ */
+typedef struct _cvs_context {
+    cvs_input		input;
+    cvs_file		*file;
+    cvs_arena		arena;
+    node_hash		nodes;
+    void		*scanner;	/* flex state for the yacc parser */
+    int			error;		/* input could not be read */
+    int			skip_blobs;	/* build history only (benchmarks) */
+} cvs_context;
+
+
 typedef struct _rev_file {
     char		*name;
     cvs_number		number;
@@ -157,9 +228,22 @@ typedef struct _rev_ref {
     int			shown;
 } rev_ref;
 
+/*
+ * Tags found while converting a file. These are attached to the
+ * global tag table once the file's rev_list is linked in, so that
+ * tags are recorded in input order however the files were loaded
+ */
+typedef struct _rev_tag {
+    struct _rev_tag	*next;
+    rev_commit		*commit;
+    char		*name;
+    char		*file;
+} rev_tag;
+
 typedef struct _rev_list {
     struct _rev_list	*next;
     rev_ref	*heads;
+    rev_tag	*tags;
     int		watch;
 } rev_list;
 
@@ -181,11 +265,34 @@ typedef enum _rev_execution_mode {
 
 extern rev_execution_mode	rev_mode;
 
-extern cvs_file     *this_file;
+int yyparse (cvs_context *ctx, void *scanner);
+
+extern int rcs_parser_fast;
+
+int
+rcs_parse (cvs_context *ctx);
+
+extern int cvs_input_mmap;
+
+extern off_t cvs_input_stream_size;
+
+int
+cvs_input_open (cvs_input *in, char *name, struct stat *st);
+
+void
+cvs_input_close (cvs_input *in);
+
+int
+cvs_input_line (cvs_input *in, char *ptr);
+
+char *
+cvs_input_data (cvs_input *in);
 
-int yyparse (void);
+cvs_text
+cvs_input_text (cvs_input *in);
 
-extern char *yyfilename;
+void
+cvs_input_discard (cvs_input *in, char *start, char *end);
 
 char *
 ctime_nonl (time_t *date);
@@ -194,13 +301,25 @@ cvs_number
 lex_number (char *);
 
 time_t
-lex_date (cvs_number *n);
+lex_date (cvs_number *n, cvs_context *ctx);
+
+int
+lex_init (cvs_context *ctx);
+
+void
+lex_fini (cvs_context *ctx);
 
 char *
-lex_text (void);
+lex_text (void *scanner);
+
+int
+lex_line (void *scanner);
 
 rev_list *
-rev_list_cvs (cvs_file *cvs);
+rev_list_cvs (cvs_context *ctx);
+
+void
+rev_list_tag_commits (rev_list *rl);
 
 rev_list *
 rev_list_merge (rev_list *lists);
@@ -228,7 +347,7 @@ typedef struct _tag {
 } Tag;
 
 extern Tag *all_tags;
-void tag_commit(rev_commit *c, char *name);
+void tag_commit(rev_commit *c, char *name, char *file);
 rev_commit **tagged(Tag *tag);
 void discard_tags(void);
 
@@ -244,6 +363,9 @@ cvs_number_compare (cvs_number *a, cvs_number *b);
 int
 cvs_number_compare_n (cvs_number *a, cvs_number *b, int l);
 
+uint32_t
+cvs_number_hash (cvs_number *n);
+
 int
 cvs_is_branch_of (cvs_number *trunk, cvs_number *branch);
 
@@ -256,14 +378,8 @@ cvs_previous_rev (cvs_number *n);
 cvs_number
 cvs_master_rev (cvs_number *n);
 
-cvs_number
-cvs_branch_head (cvs_file *f, cvs_number *branch);
-
-cvs_number
-cvs_branch_parent (cvs_file *f, cvs_number *branch);
-
 Node *
-cvs_find_version (cvs_file *cvs, cvs_number *number);
+cvs_find_version (cvs_file *cvs, node_hash *nodes, cvs_number *number);
 
 int
 cvs_is_trunk (cvs_number *number);
@@ -271,8 +387,11 @@ cvs_is_trunk (cvs_number *number);
 int
 cvs_is_vendor (cvs_number *number);
 
+void *
+cvs_arena_alloc (cvs_arena *arena, size_t size);
+
 void
-cvs_file_free (cvs_file *cvs);
+cvs_arena_free (cvs_arena *arena);
 
 char *
 cvs_number_string (cvs_number *n, char *str);
@@ -343,11 +462,15 @@ dump_rev_graph (rev_list *rl, char *title);
 void
 dump_rev_tree (rev_list *rl);
 
-extern int yylex (void);
-
 char *
 atom (char *string);
 
+char *
+atom_n (char *string, size_t len);
+
+void
+atom_stats (FILE *f);
+
 void
 discard_atoms (void);
 
@@ -395,8 +518,6 @@ rev_list_validate (rev_list *rl);
 int
 git_rev_list_commit (rev_list *rl, int strip);
 
-void
-git_rev_list_pack (rev_list *rl, int strip);
     
 int
 git_system (char *command);
@@ -410,16 +531,41 @@ git_string_to_system (char *command, char *string);
 char *
 git_format_command (const char *fmt, ...);
 
+void
+git_lock_objects (void);
+
+void
+git_unlock_objects (void);
+
 void
 git_free_author_map (void);
 
+char *
+git_pack_directory (void);
+
+extern int pack_deltas;
+extern unsigned long pack_max_bytes;
+
+int
+pack_sha1_file (void *buf, unsigned long len, const char *type,
+		unsigned char *sha1);
+
+void
+pack_blob (void *text, unsigned long len, const unsigned char *base,
+	   void *delta, unsigned long delta_len, unsigned char *sha1);
+
+void
+pack_flush (void);
+
 /*
  * rev - string representation of the rcs revision number eg. 1.1
  * path - RCS filename path eg. ./cfb16/Makefile,v
  * sha1_hex - a buffer of at least 41 characterrs to receive
  *           the ascii hexidecimal id of the resulting object
  */
-void generate_files(cvs_file *cvs);
+extern int checkout_jobs;
+
+unsigned long generate_files(cvs_context *ctx, int store);
 
 rev_dir **
 rev_pack_files (rev_file **files, int nfiles, int *ndr);
@@ -430,12 +576,11 @@ rev_free_dirs (void);
 void
 rev_commit_cleanup (void);
 
-void hash_version(cvs_version *);
-void hash_patch(cvs_patch *);
-void hash_branch(cvs_branch *);
-void clean_hash(void);
-void build_branches(void);
-extern Node *head_node;
+void hash_version(node_hash *, cvs_version *);
+void hash_patch(node_hash *, cvs_patch *);
+void hash_branch(node_hash *, cvs_branch *);
+void build_branches(node_hash *);
+Node *node_find(node_hash *, cvs_number *);
 
 void delete_commit(rev_commit *);
 void set_commit(rev_commit *);
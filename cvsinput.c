@@ -0,0 +1,249 @@
+/*
+ *  Copyright © 2006 Keith Packard <keithp@keithp.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "cvs.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/*
+ * Each ,v file is made available to the parser as a single
+ * contiguous block of bytes. Regular files are mapped directly;
+ * pipes and other special files are read into a heap buffer.
+ * Either way, the byte at 'end' is readable and zero so that
+ * scanners can peek one byte past the closing '@' of the last
+ * string in the file.
+ *
+ * Mapped files of cvs_input_stream_size bytes or more are streamed:
+ * each delta text's pages are dropped once the parser has found its
+ * end, and rcs2git drops them again when it is done with them, so
+ * only the parts in use stay resident.
+ */
+
+int cvs_input_mmap = 1;
+off_t cvs_input_stream_size = 256 << 20;
+
+#define CVS_INPUT_CHUNK	65536
+
+static int
+cvs_input_read (cvs_input *in, int fd)
+{
+    size_t  size = 0, alloc = 0;
+    char    *buf = NULL;
+    ssize_t n;
+
+    for (;;) {
+	if (size + 1 >= alloc) {
+	    alloc = alloc ? alloc * 2 : CVS_INPUT_CHUNK;
+	    buf = realloc (buf, alloc);
+	    if (!buf)
+		return -1;
+	}
+	n = read (fd, buf + size, alloc - size);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    free (buf);
+	    return -1;
+	}
+	if (n == 0)
+	    break;
+	size += n;
+    }
+    buf[size] = '\0';
+    in->base = buf;
+    in->end = buf + size;
+    in->mapped = 0;
+    return 0;
+}
+
+/*
+ * Reserve an anonymous region one byte larger than the file and
+ * map the file over the front of it; the remainder of the last
+ * page, or the following anonymous page, provides the trailing zero
+ */
+static int
+cvs_input_map (cvs_input *in, int fd, size_t size)
+{
+    size_t  page = sysconf (_SC_PAGESIZE);
+    size_t  len = (size + 1 + page - 1) & ~(page - 1);
+    void    *base, *map;
+
+    base = mmap (NULL, len, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+	return -1;
+    map = mmap (base, size, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0);
+    if (map == MAP_FAILED) {
+	munmap (base, len);
+	return -1;
+    }
+    (void) madvise (map, size, MADV_SEQUENTIAL);
+    in->base = map;
+    in->end = in->base + size;
+    in->mapped = len;
+    return 0;
+}
+
+int
+cvs_input_open (cvs_input *in, char *name, struct stat *st)
+{
+    int	    fd;
+
+    memset (in, 0, sizeof (cvs_input));
+    in->name = name;
+    fd = open (name, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    if (fstat (fd, st) < 0) {
+	close (fd);
+	return -1;
+    }
+    if (!cvs_input_mmap || !S_ISREG (st->st_mode) || st->st_size == 0 ||
+	cvs_input_map (in, fd, st->st_size) < 0)
+    {
+	if (cvs_input_read (in, fd) < 0) {
+	    close (fd);
+	    return -1;
+	}
+    }
+    in->stream = in->mapped && st->st_size >= cvs_input_stream_size;
+    close (fd);
+    in->ptr = in->base;
+    return 0;
+}
+
+void
+cvs_input_close (cvs_input *in)
+{
+    if (in->mapped)
+	munmap (in->base, in->mapped);
+    else
+	free (in->base);
+    memset (in, 0, sizeof (cvs_input));
+}
+
+int
+cvs_input_line (cvs_input *in, char *ptr)
+{
+    char    *p;
+    int	    line = 1;
+
+    for (p = in->base; p < ptr && (p = memchr (p, '\n', ptr - p)); p++)
+	line++;
+    return line;
+}
+
+/*
+ * Locate the end of the string starting at in->ptr, just past the
+ * opening '@'. Returns the closing '@' and counts the '@@' escapes
+ * along the way
+ */
+static char *
+cvs_input_string_end (cvs_input *in, int *nescape)
+{
+    char    *p = in->ptr;
+    char    *at;
+
+    *nescape = 0;
+    for (;;) {
+	at = memchr (p, '@', in->end - p);
+	if (!at) {
+	    fprintf (stderr, "%s: (%d) unterminated string\n",
+		     in->name, cvs_input_line (in, in->ptr));
+	    return in->end;
+	}
+	if (at[1] != '@')
+	    return at;
+	++*nescape;
+	p = at + 2;
+    }
+}
+
+/*
+ * Delta text is left in the input buffer; rcs2git reads the
+ * escaped bytes in place
+ */
+cvs_text
+cvs_input_text (cvs_input *in)
+{
+    cvs_text	text;
+    char	*close;
+    int		nescape;
+
+    close = cvs_input_string_end (in, &nescape);
+    if (close < in->end) {
+	text.text = in->ptr - 1;
+	text.length = close - text.text + 1;
+	in->ptr = close + 1;
+	if (in->stream)
+	    cvs_input_discard (in, text.text, close);
+    } else {
+	text.text = "@@";
+	text.length = 2;
+	in->ptr = close;
+    }
+    return text;
+}
+
+/*
+ * Let the pages wholly within start..end of a streamed file go;
+ * they are read back from the file if touched again
+ */
+void
+cvs_input_discard (cvs_input *in, char *start, char *end)
+{
+    size_t  page = sysconf (_SC_PAGESIZE);
+    char    *s = (char *) (((uintptr_t) start + page - 1) & ~(page - 1));
+    char    *e = (char *) ((uintptr_t) end & ~(page - 1));
+
+    if (in->stream && s < e)
+	(void) madvise (s, e - s, MADV_DONTNEED);
+}
+
+/*
+ * Other strings are unescaped and turned into atoms
+ */
+char *
+cvs_input_data (cvs_input *in)
+{
+    char    *start = in->ptr;
+    char    *close;
+    char    *ret, *r, *p, *at;
+    int	    nescape;
+
+    close = cvs_input_string_end (in, &nescape);
+    if (!nescape) {
+	in->ptr = close < in->end ? close + 1 : close;
+	return atom_n (start, close - start);
+    }
+    r = ret = malloc (close - start - nescape + 1);
+    for (p = start; p < close; p = at + 2) {
+	at = memchr (p, '@', close - p);
+	if (!at) {
+	    memcpy (r, p, close - p);
+	    r += close - p;
+	    break;
+	}
+	memcpy (r, p, at - p + 1);
+	r += at - p + 1;
+    }
+    *r = '\0';
+    in->ptr = close < in->end ? close + 1 : close;
+    r = atom (ret);
+    free (ret);
+    return r;
+}
@@ -109,6 +109,23 @@ cvs_number_compare_n (cvs_number *a, cvs_number *b, int l)
     return 0;
 }
 
+/*
+ * Revision numbers within a file share most of their components,
+ * so every component is mixed in rather than summed
+ */
+uint32_t
+cvs_number_hash (cvs_number *n)
+{
+    uint32_t	h = n->c;
+    int		i;
+
+    for (i = 0; i < n->c; i++) {
+	h = (h ^ (uint16_t) n->n[i]) * 0x9e3779b1;
+	h ^= h >> 15;
+    }
+    return h ^ (h >> 16);
+}
+
 int
 cvs_is_branch_of (cvs_number *trunk, cvs_number *branch)
 {
@@ -167,52 +184,27 @@ cvs_master_rev (cvs_number *n)
 }
 
 /*
- * Find the newest revision along a specific branch
+ * Find the oldest revision along a branch which is newer than number
  */
-
-cvs_number
-cvs_branch_head (cvs_file *f, cvs_number *branch)
-{
-    cvs_number	n;
-    cvs_version	*v;
-
-    n = *branch;
-    /* Check for magic branch format */
-    if ((n.c & 1) == 0 && n.n[n.c-2] == 0) {
-	n.n[n.c-2] = n.n[n.c-1];
-	n.c--;
-    }
-    for (v = f->versions; v; v = v->next) {
-	if (cvs_same_branch (&n, &v->number) &&
-	    cvs_number_compare (&n, &v->number) > 0)
-	    n = v->number;
-    }
-    return n;
-}
-
-cvs_number
-cvs_branch_parent (cvs_file *f, cvs_number *branch)
-{
-    cvs_number	n;
-    cvs_version	*v;
-
-    n = *branch;
-    n.n[n.c-1] = 0;
-    for (v = f->versions; v; v = v->next) {
-	if (cvs_same_branch (&n, &v->number) &&
-	    cvs_number_compare (branch, &v->number) < 0 &&
-	    cvs_number_compare (&n, &v->number) >= 0)
-	    n = v->number;
-    }
-    return n;
-}
-
 Node *
-cvs_find_version (cvs_file *cvs, cvs_number *number)
+cvs_find_version (cvs_file *cvs, node_hash *nodes, cvs_number *number)
 {
     cvs_version *cv;
     cvs_version	*nv = NULL;
+    cvs_number	first;
+    Node	*node;
 
+    /*
+     * Revisions along a branch count up from 1, so when starting
+     * from the base of the branch, look that one up directly
+     */
+    if (number->n[number->c-1] < 1) {
+	first = *number;
+	first.n[first.c-1] = 1;
+	node = node_find (nodes, &first);
+	if (node && node->v)
+	    return node;
+    }
     for (cv = cvs->versions; cv; cv = cv->next) {
 	if (cvs_same_branch (number, &cv->number) &&
 	    cvs_number_compare (&cv->number, number) > 0 &&
@@ -244,60 +236,52 @@ cvs_is_vendor (cvs_number *number)
     return 1;
 }
 
-static void
-cvs_symbol_free (cvs_symbol *symbol)
-{
-    cvs_symbol	*s;
-
-    while ((s = symbol)) {
-	symbol = s->next;
-	free (s);
-    }
-}
-
-static void
-cvs_branch_free (cvs_branch *branch)
-{
-    cvs_branch	*b;
-
-    while ((b = branch)) {
-	branch = b->next;
-	free (b);
-    }
-}
+#define ARENA_MIN_BLOCK	(4 * 1024)
+#define ARENA_MAX_BLOCK	(256 * 1024)
 
-static void
-cvs_version_free (cvs_version *version)
+/*
+ * Return zeroed memory which lives until cvs_arena_free. Blocks
+ * double in size up to ARENA_MAX_BLOCK, so small files stay small
+ * while large ones need few blocks
+ */
+void *
+cvs_arena_alloc (cvs_arena *arena, size_t size)
 {
-    cvs_version	*v;
-
-    while ((v = version)) {
-	version = v->next;
-	cvs_branch_free (v->branches);
-	free (v);
+    cvs_arena_block *b;
+    size_t	    bsize;
+    char	    *p;
+
+    size = (size + sizeof (double) - 1) & ~(sizeof (double) - 1);
+    if (size > arena->nfree) {
+	if (arena->size < ARENA_MIN_BLOCK)
+	    arena->size = ARENA_MIN_BLOCK;
+	bsize = max (arena->size, size);
+	b = calloc (1, sizeof (cvs_arena_block) + bsize);
+	b->next = arena->blocks;
+	arena->blocks = b;
+	arena->free = (char *) b->data;
+	arena->nfree = bsize;
+	if (arena->size < ARENA_MAX_BLOCK)
+	    arena->size *= 2;
     }
+    p = arena->free;
+    arena->free += size;
+    arena->nfree -= size;
+    return p;
 }
 
-static void
-cvs_patch_free (cvs_patch *patch)
+void
+cvs_arena_free (cvs_arena *arena)
 {
-    cvs_patch	*v;
+    cvs_arena_block *b;
 
-    while ((v = patch)) {
-	patch = v->next;
-	free (v->text);
-	free (v);
+    while ((b = arena->blocks)) {
+	arena->blocks = b->next;
+	free (b);
     }
-}
-
-void
-cvs_file_free (cvs_file *cvs)
-{
-    cvs_symbol_free (cvs->symbols);
-    cvs_version_free (cvs->versions);
-    cvs_patch_free (cvs->patches);
-    free (cvs);
-    clean_hash();
+    arena->free = NULL;
+    arena->nfree = 0;
+    arena->size = 0;
 }
 
 char *
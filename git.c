@@ -19,30 +19,9 @@
 #include "cvs.h"
 #include "cache.h"
 #include "commit.h"
+#include "tag.h"
 #include "utf8.h"
 
-static int
-git_filename (rev_file *file, char *name, int strip)
-{
-    char    *attic;
-    int	    l;
-    int	    len;
-    
-    if (strlen (file->name) - strip >= MAXPATHLEN)
-	return 0;
-    strcpy (name, file->name + strip);
-    while ((attic = strstr (name, "Attic/")) &&
-	   (attic == name || attic[-1] == '/'))
-    {
-	l = strlen (attic);
-	memmove (attic, attic + 6, l - 5);
-    }
-    len = strlen (name);
-    if (len > 2 && !strcmp (name + len - 2, ",v"))
-	name[len-2] = '\0';
-    return 1;
-}
-
 #define GIT_CVS_DIR ".git-cvs"
 
 static char *
@@ -321,7 +300,7 @@ git_commit(rev_commit *commit)
 		add_buffer(&size, "encoding %s\n", git_commit_encoding);
 	add_buffer(&size, "\n%s", log);
 
-	if (write_sha1_file(commit_text, size, commit_type, commit_sha1))
+	if (pack_sha1_file(commit_text, size, commit_type, commit_sha1))
 		return 0;
 
 	commit->sha1 = atom(sha1_to_hex(commit_sha1));
@@ -330,49 +309,71 @@ git_commit(rev_commit *commit)
 	return 1;
 }
 
+/*
+ * Git only takes refs to objects it can read, and nothing in the
+ * pack being written can be read until it is finished, so refs are
+ * collected while committing and set afterwards
+ */
+typedef struct _git_ref {
+    struct _git_ref	*next;
+    char		*sha1;
+    char		*type;
+    char		*name;
+} git_ref;
+
+static git_ref	*git_refs, **git_refs_tail = &git_refs;
+
 static int
 git_update_ref (char *sha1, char *type, char *name)
 {
-    char    *command;
-    int	    n;
+    git_ref *r = calloc (1, sizeof (git_ref));
 
-    command = git_format_command ("git update-ref 'refs/%s/%s' '%s'",
-				  type, name, sha1);
-    if (!command)
-	return 0;
-    n = git_system (command);
-    free (command);
-    if (n != 0)
+    if (!r)
 	return 0;
+    r->sha1 = sha1;
+    r->type = type;
+    r->name = name;
+    *git_refs_tail = r;
+    git_refs_tail = &r->next;
     return 1;
 }
 
+static int
+git_update_refs (void)
+{
+    git_ref *r;
+    char    *command;
+    int	    n = 0;
+
+    while ((r = git_refs)) {
+	git_refs = r->next;
+	if (!n) {
+	    command = git_format_command ("git update-ref 'refs/%s/%s' '%s'",
+					  r->type, r->name, r->sha1);
+	    if (!command || git_system (command) != 0)
+		n = 1;
+	    free (command);
+	}
+	free (r);
+    }
+    git_refs_tail = &git_refs;
+    return !n;
+}
+
 static char *
 git_mktag (rev_commit *commit, char *name)
 {
-    char    *filename;
-    FILE    *f;
-    int     rv;
-    char    *command;
-    char    *tag_sha1;
-    cvs_author *author;
+    unsigned char   tag_sha1[20];
+    size_t	    size = 0;
+    cvs_author	    *author;
 
-    filename = git_cvs_file ("tag");
-    if (!filename)
-	return NULL;
-    f = fopen (filename, "w");
-    if (!f) {
-	fprintf (stderr, "%s: %s\n", filename, strerror (errno));
-	return NULL;
-    }
-    
     author = git_fullname (commit->author);
     if (author == NULL) {
       fprintf (stderr, "No author info for tagger %s\n", commit->author);
       return NULL;
     }
 
-    rv = fprintf (f,
+    add_buffer (&size,
 		"object %s\n"
 		"type commit\n"
 		"tag %s\n"
@@ -381,28 +382,9 @@ git_mktag (rev_commit *commit, char *name)
 		commit->sha1,
 		name,
 		author->full, author->email, commit->date);
-    if (rv < 1) {
-	fprintf (stderr, "%s: %s\n", filename, strerror (errno));
-	fclose (f);
-	unlink (filename);
-	return NULL;
-    }
-    rv = fclose (f);
-    if (rv) {
-	fprintf (stderr, "%s: %s\n", filename, strerror (errno));
-	unlink (filename);
-	return NULL;
-    }
-
-    command = git_format_command ("git mktag < '%s'", filename);
-    if (!command) {
-	unlink (filename);
+    if (pack_sha1_file (commit_text, size, tag_type, tag_sha1))
 	return NULL;
-    }
-    tag_sha1 = git_system_to_string (command);
-    unlink (filename);
-    free (command);
-    return tag_sha1;
+    return atom (sha1_to_hex (tag_sha1));
 }
 
 static int
@@ -484,85 +466,15 @@ git_rev_list_commit (rev_list *rl, int strip)
 	if (!git_head_commit (h, strip))
 	    return 0;
     fprintf (STATUS, "\n");
+    pack_flush ();
+    if (!git_update_refs ())
+	return 0;
 //    if (!git_checkout ("master"))
 //	return 0;
     return 1;
 }
 
-static FILE *packf;
-
-static char *
-git_start_pack (void)
-{
-    char    *pack_file = git_cvs_file ("pack");
-
-    packf = fopen (pack_file, "w");
-    if (!packf)
-	return NULL;
-    return pack_file;
-}
-
-static void
-git_file_pack (rev_file *file, int strip)
-{
-    char    filename[MAXPATHLEN + 1];
-
-    if (!git_filename (file, filename, strip))
-	return;
-    fprintf (packf, "%s %s\n", file->sha1, filename);
-}
-
-extern void reprepare_packed_git (void);
-
-static void
-git_end_pack (char *pack_file, char *pack_dir)
-{
-    char    *command;
-    char    *pack_name;
-    char    *src_pack_pack, *src_pack_idx;
-    char    *dst_pack_pack, *dst_pack_idx;
-
-    if (fclose (packf) == EOF)
-	return;
-    command = git_format_command ("git pack-objects -q --non-empty .tmp-pack < '%s'", 
-				  pack_file);
-    if (!command) {
-	unlink (pack_file);
-	return;
-    }
-    pack_name = git_system_to_string (command);
-    unlink (pack_file);
-    free (command);
-    if (!pack_name)
-	return;
-    fprintf (STATUS, "Pack pack-%s created\n", pack_name);
-    fflush (STATUS);
-    src_pack_pack = git_format_command (".tmp-pack-%s.pack", pack_name);
-    src_pack_idx = git_format_command (".tmp-pack-%s.idx", pack_name);
-    dst_pack_pack = git_format_command ("%s/pack-%s.pack", pack_dir, pack_name);
-    dst_pack_idx = git_format_command ("%s/pack-%s.idx", pack_dir, pack_name);
-    if (!src_pack_pack || !src_pack_idx ||
-	!dst_pack_pack || !dst_pack_idx)
-    {
-	if (src_pack_pack) free (src_pack_pack);
-	if (src_pack_idx) free (src_pack_idx);
-	if (dst_pack_pack) free (dst_pack_pack);
-	if (dst_pack_idx) free (dst_pack_idx);
-	return;
-    }
-    if (rename (src_pack_pack, dst_pack_pack) == -1 ||
-	rename (src_pack_idx, dst_pack_idx) == -1)
-	return;
-    free (src_pack_pack);
-    free (src_pack_idx);
-    free (dst_pack_pack);
-    free (dst_pack_idx);
-    
-    (void) git_system ("git prune-packed");
-    reprepare_packed_git ();
-}
-
-static char *
+char *
 git_pack_directory (void)
 {
     static char    *pack_dir;
@@ -597,36 +509,3 @@ git_pack_directory (void)
     }
     return pack_dir;
 }
-
-void
-git_rev_list_pack (rev_list *rl, int strip)
-{
-    char    *pack_file;
-    char    *pack_dir;
-    
-    pack_dir = git_pack_directory ();
-    if (!pack_dir)
-	return;
-    pack_file = git_start_pack ();
-    if (!pack_file)
-	return;
-    
-    while (rl) {
-	rev_ref	*h;
-	rev_commit	*c;
-
-	for (h = rl->heads; h; h = h->next) {
-	    if (h->tail)
-		continue;
-	    for (c = h->commit; c; c = c->parent) {
-		if (c->file)
-		    git_file_pack (c->file, strip);
-		if (c->tail)
-		    break;
-	    }
-	}
-	rl = rl->next;
-    }
-    git_end_pack (pack_file, pack_dir);
-}
-
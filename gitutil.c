@@ -17,6 +17,25 @@
  */
 
 #include "cvs.h"
+#include <pthread.h>
+
+/*
+ * The git object store code keeps global state; files being loaded
+ * in parallel write their blobs through it one at a time
+ */
+static pthread_mutex_t	git_objects = PTHREAD_MUTEX_INITIALIZER;
+
+void
+git_lock_objects (void)
+{
+    pthread_mutex_lock (&git_objects);
+}
+
+void
+git_unlock_objects (void)
+{
+    pthread_mutex_unlock (&git_objects);
+}
 
 int
 git_system (char *command)
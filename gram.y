@@ -19,14 +19,20 @@
 
 #include "cvs.h"
     
-void yyerror (char *msg);
+void yyerror (cvs_context *ctx, void *scanner, char *msg);
 
 %}
 
+%define api.pure
+%parse-param { cvs_context *ctx }
+%parse-param { void *scanner }
+%lex-param { void *scanner }
+
 %union {
     int		i;
     time_t	date;
     char	*s;
+    cvs_text	text;
     cvs_number	number;
     cvs_symbol	*symbol;
     cvs_version	*version;
@@ -37,15 +43,21 @@ void yyerror (char *msg);
     cvs_file	*file;
 }
 
+%{
+int yylex (YYSTYPE *lvalp, void *scanner);
+%}
+
 %token		HEAD BRANCH ACCESS SYMBOLS LOCKS COMMENT DATE
 %token		BRANCHES NEXT COMMITID EXPAND
 %token		DESC LOG TEXT STRICT AUTHOR STATE
 %token		SEMI COLON
 %token		BRAINDAMAGED_NUMBER
-%token <s>	HEX NAME DATA TEXT_DATA
+%token <s>	HEX NAME DATA
+%token <text>	TEXT_DATA
 %token <number>	NUMBER
 
-%type <s>	text log
+%type <s>	log
+%type <text>	text
 %type <symbol>	symbollist symbol symbols
 %type <version>	revision
 %type <vlist>	revisions
@@ -68,16 +80,16 @@ headers		: header headers
 		|
 		;
 header		: HEAD opt_number SEMI
-		  { this_file->head = $2; }
+		  { ctx->file->head = $2; }
 		| BRANCH NUMBER SEMI
-		  { this_file->branch = $2; }
+		  { ctx->file->branch = $2; }
 		| ACCESS SEMI
 		| symbollist
-		  { this_file->symbols = $1; }
+		  { ctx->file->symbols = $1; }
 		| LOCKS locks SEMI lock_type
 		| COMMENT DATA SEMI
 		| EXPAND DATA SEMI
-		  { this_file->expand = $2; }
+		  { ctx->file->expand = $2; }
 		;
 locks		: locks lock
 		|
@@ -99,7 +111,7 @@ symbols		: symbols symbol
 		;
 symbol		: name COLON NUMBER
 		  {
-			$$ = calloc (1, sizeof (cvs_symbol));
+			$$ = cvs_arena_alloc (&ctx->arena, sizeof (cvs_symbol));
 			$$->name = $1;
 			$$->number = $3;
 		  }
@@ -120,11 +132,11 @@ name		: NAME
 revisions	: revisions revision
 		  { *$1 = $2; $$ = &$2->next; }
 		|
-		  { $$ = &this_file->versions; }
+		  { $$ = &ctx->file->versions; }
 		;
 revision	: NUMBER date author state branches next opt_commitid
 		  {
-			$$ = calloc (1, sizeof (cvs_version));
+			$$ = cvs_arena_alloc (&ctx->arena, sizeof (cvs_version));
 			$$->number = $1;
 			$$->date = $2;
 			$$->author = $3;
@@ -133,13 +145,13 @@ revision	: NUMBER date author state branches next opt_commitid
 			$$->branches = $5;
 			$$->parent = $6;
 			$$->commitid = $7;
-			hash_version($$);
-			++this_file->nversions;
+			hash_version(&ctx->nodes, $$);
+			++ctx->file->nversions;
 		  }
 		;
 date		: DATE NUMBER SEMI
 		  {
-			$$ = lex_date (&$2);
+			$$ = lex_date (&$2, ctx);
 		  }
 		;
 author		: AUTHOR NAME SEMI
@@ -153,10 +165,10 @@ branches	: BRANCHES numbers SEMI
 		;
 numbers		: NUMBER numbers
 		  {
-			$$ = calloc (1, sizeof (cvs_branch));
+			$$ = cvs_arena_alloc (&ctx->arena, sizeof (cvs_branch));
 			$$->next = $2;
 			$$->number = $1;
-			hash_branch($$);
+			hash_branch(&ctx->nodes, $$);
 		  }
 		|
 		  { $$ = NULL; }
@@ -183,14 +195,14 @@ desc		: DESC DATA
 patches		: patches patch
 		  { *$1 = $2; $$ = &$2->next; }
 		|
-		  { $$ = &this_file->patches; }
+		  { $$ = &ctx->file->patches; }
 		;
 patch		: NUMBER log text
-		  { $$ = calloc (1, sizeof (cvs_patch));
+		  { $$ = cvs_arena_alloc (&ctx->arena, sizeof (cvs_patch));
 		    $$->number = $1;
 		    $$->log = $2;
 		    $$->text = $3;
-		    hash_patch($$);
+		    hash_patch(&ctx->nodes, $$);
 		  }
 		;
 log		: LOG DATA
@@ -201,7 +213,7 @@ text		: TEXT TEXT_DATA
 		;
 %%
 
-void yyerror (char *msg)
+void yyerror (cvs_context *ctx, void *scanner, char *msg)
 {
-	fprintf (stderr, "parse error %s at %s\n", msg, lex_text ());
+	fprintf (stderr, "parse error %s at %s\n", msg, lex_text (scanner));
 }
@@ -1,68 +1,95 @@
 #include "cvs.h"
 
-static Node *table[4096];
-static int entries;
+/*
+ * Nodes live in an open-addressed, linearly probed table which is
+ * kept at most half full.
+ */
+#define NODE_HASH_MIN	64
 
-Node *head_node;
+static int same_number(cvs_number *a, cvs_number *b)
+{
+	return a->c == b->c &&
+		!memcmp(a->n, b->n, a->c * sizeof(a->n[0]));
+}
 
-static Node *hash_number(cvs_number *n)
+/*
+ * Return the slot holding key, or the empty slot where it belongs
+ */
+static Node **lookup(node_hash *nodes, cvs_number *key)
 {
-	cvs_number key = *n;
+	unsigned mask = nodes->size - 1;
+	unsigned i = cvs_number_hash(key) & mask;
 	Node *p;
-	int hash;
+
+	while ((p = nodes->table[i]) && !same_number(&p->number, key))
+		i = (i + 1) & mask;
+	return &nodes->table[i];
+}
+
+/*
+ * Tables come from the arena along with the Nodes, so outgrown
+ * ones are released with everything else once the file is done
+ */
+static void grow(node_hash *nodes)
+{
+	Node **old = nodes->table;
+	int size = nodes->size;
 	int i;
 
+	nodes->size = size ? size * 2 : NODE_HASH_MIN;
+	nodes->table = cvs_arena_alloc(nodes->arena,
+				       nodes->size * sizeof(Node *));
+	for (i = 0; i < size; i++)
+		if (old[i])
+			*lookup(nodes, &old[i]->number) = old[i];
+}
+
+static Node *hash_number(node_hash *nodes, cvs_number *n)
+{
+	cvs_number key = *n;
+	Node **slot;
+	Node *p;
+
 	if (key.c > 2 && !key.n[key.c - 2]) {
 		key.n[key.c - 2] = key.n[key.c - 1];
 		key.c--;
 	}
 	if (key.c & 1)
 		key.n[key.c] = 0;
-	for (i = 0, hash = 0; i < key.c - 1; i++)
-		hash += key.n[i];
-	hash = (hash * 256 + key.n[key.c - 1]) % 4096;
-	for (p = table[hash]; p; p = p->hash_next) {
-		if (p->number.c != key.c)
-			continue;
-		for (i = 0; i < key.c && p->number.n[i] == key.n[i]; i++)
-			;
-		if (i == key.c)
-			return p;
-	}
-	p = calloc(1, sizeof(Node));
+	if (nodes->entries * 2 >= nodes->size)
+		grow(nodes);
+	slot = lookup(nodes, &key);
+	if (*slot)
+		return *slot;
+	p = cvs_arena_alloc(nodes->arena, sizeof(Node));
 	p->number = key;
-	p->hash_next = table[hash];
-	table[hash] = p;
-	entries++;
+	*slot = p;
+	nodes->entries++;
 	return p;
 }
 
-static Node *find_parent(cvs_number *n, int depth)
+/*
+ * Exact lookup of a revision number, without adding it
+ */
+Node *node_find(node_hash *nodes, cvs_number *n)
+{
+	if (!nodes->size)
+		return NULL;
+	return *lookup(nodes, n);
+}
+
+static Node *find_parent(node_hash *nodes, cvs_number *n, int depth)
 {
 	cvs_number key = *n;
-	Node *p;
-	int hash;
-	int i;
 
 	key.c -= depth;
-	for (i = 0, hash = 0; i < key.c - 1; i++)
-		hash += key.n[i];
-	hash = (hash * 256 + key.n[key.c - 1]) % 4096;
-	for (p = table[hash]; p; p = p->hash_next) {
-		if (p->number.c != key.c)
-			continue;
-		for (i = 0; i < key.c && p->number.n[i] == key.n[i]; i++)
-			;
-		if (i == key.c)
-			break;
-	}
-	return p;
+	return *lookup(nodes, &key);
 }
 
-void hash_version(cvs_version *v)
+void hash_version(node_hash *nodes, cvs_version *v)
 {
 	char name[CVS_MAX_REV_LEN];
-	v->node = hash_number(&v->number);
+	v->node = hash_number(nodes, &v->number);
 	if (v->node->v) {
 		fprintf(stderr, "more than one delta with number %s\n",
 			cvs_number_string(&v->node->number, name));
@@ -75,10 +102,10 @@ void hash_version(cvs_version *v)
 	}
 }
 
-void hash_patch(cvs_patch *p)
+void hash_patch(node_hash *nodes, cvs_patch *p)
 {
 	char name[CVS_MAX_REV_LEN];
-	p->node = hash_number(&p->number);
+	p->node = hash_number(nodes, &p->number);
 	if (p->node->p) {
 		fprintf(stderr, "more than one delta with number %s\n",
 			cvs_number_string(&p->node->number, name));
@@ -91,25 +118,9 @@ void hash_patch(cvs_patch *p)
 	}
 }
 
-void hash_branch(cvs_branch *b)
+void hash_branch(node_hash *nodes, cvs_branch *b)
 {
-	b->node = hash_number(&b->number);
-}
-
-void clean_hash(void)
-{
-	int i;
-	for (i = 0; i < 4096; i++) {
-		Node *p = table[i];
-		table[i] = NULL;
-		while (p) {
-			Node *q = p->hash_next;
-			free(p);
-			p = q;
-		}
-	}
-	entries = 0;
-	head_node = NULL;
+	b->node = hash_number(nodes, &b->number);
 }
 
 static int compare(const void *a, const void *b)
@@ -130,7 +141,7 @@ static int compare(const void *a, const void *b)
 	return 0;
 }
 
-static void try_pair(Node *a, Node *b)
+static void try_pair(node_hash *nodes, Node *a, Node *b)
 {
 	int n = a->number.c;
 	int i;
@@ -150,38 +161,37 @@ static void try_pair(Node *a, Node *b)
 			return;
 		}
 	} else if (n == 2) {
-		head_node = a;
+		nodes->head_node = a;
 	}
 	if ((b->number.c & 1) == 0) {
 		b->starts = 1;
 		/* can the code below ever be needed? */
-		Node *p = find_parent(&b->number, 1);
+		Node *p = find_parent(nodes, &b->number, 1);
 		if (p)
 			p->next = b;
 	}
 }
 
-void build_branches(void)
+void build_branches(node_hash *nodes)
 {
+	int entries = nodes->entries;
 	Node **v = malloc(sizeof(Node *) * entries), **p = v;
 	int i;
 
-	for (i = 0; i < 4096; i++) {
-		Node *q;
-		for (q = table[i]; q; q = q->hash_next)
-			*p++ = q;
-	}
+	for (i = 0; i < nodes->size; i++)
+		if (nodes->table[i])
+			*p++ = nodes->table[i];
 	qsort(v, entries, sizeof(Node *), compare);
 	/* only trunk? */
 	if (v[entries-1]->number.c == 2)
-		head_node = v[entries-1];
+		nodes->head_node = v[entries-1];
 	for (p = v + entries - 2 ; p >= v; p--)
-		try_pair(p[0], p[1]);
+		try_pair(nodes, p[0], p[1]);
 	for (p = v + entries - 1 ; p >= v; p--) {
 		Node *a = *p, *b = NULL;
 		if (!a->starts)
 			continue;
-		b = find_parent(&a->number, 2);
+		b = find_parent(nodes, &a->number, 2);
 		if (!b) {
 			char name[CVS_MAX_REV_LEN];
 			fprintf(stderr, "no parent for %s\n",
@@ -0,0 +1,490 @@
+/*
+ *  Copyright © 2006 Keith Packard <keithp@keithp.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "cvs.h"
+#include "cache.h"
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include SHA1_HEADER
+
+/*
+ * Every object is appended to a pack as it is made; nothing is ever
+ * written loose. Once a pack grows past pack_max_bytes, or
+ * PACK_SIZE_LIMIT, it is handed to a finisher thread and the next
+ * object starts another. Finishing means reading the pack back to
+ * checksum it and writing its index, so doing that on the side keeps
+ * the writers from stalling on every pack. Git cannot read objects
+ * from a pack until it is finished, so pack_flush finishes the
+ * current pack early and waits for the finisher when something
+ * outside needs them.
+ *
+ * The names of all objects written go into one table, which answers
+ * whether an object already exists without asking the filesystem.
+ * Objects in the current pack also keep their offset there, so blobs
+ * may go in as an OFS_DELTA against the revision they were made from.
+ */
+int pack_deltas;
+unsigned long pack_max_bytes;
+
+#define OBJ_COMMIT	1
+#define OBJ_TREE	2
+#define OBJ_BLOB	3
+#define OBJ_TAG		4
+#define OBJ_OFS_DELTA	6
+
+/* keep chains short enough that reading a blob back stays cheap */
+#define PACK_DELTA_DEPTH	50
+
+/* version 1 index files hold 32 bit offsets */
+#define PACK_SIZE_LIMIT		((off_t) 1 << 31)
+
+/* packs written but not yet finished, each holding an open file */
+#define PACK_FINISH_QUEUE	4
+
+typedef struct _pack_object {
+    unsigned char   sha1[20];
+    uint32_t	    offset;
+    uint32_t	    depth;
+} pack_object;
+
+/* A written pack waiting for the finisher, with its own object list */
+typedef struct _pack_job {
+    struct _pack_job	*next;
+    FILE		*file;
+    char		*tmp;
+    uint32_t		count;
+    pack_object		*objects;
+} pack_job;
+
+extern void reprepare_packed_git (void);
+
+static pthread_mutex_t	pack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE		*pack_file;
+static char		*pack_tmp;
+static off_t		pack_offset;
+static pack_object	*pack_objects;
+static uint32_t		pack_nobjects, pack_maxobjects;
+static uint32_t		pack_first;	/* first object in the current pack */
+static uint32_t		*pack_hash;	/* object index + 1, 0 when empty */
+static uint32_t		pack_nhash;
+static unsigned char	*pack_zbuf;
+static unsigned long	pack_zsize;
+
+static pthread_mutex_t	finish_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	finish_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	finish_done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t	finish_once = PTHREAD_ONCE_INIT;
+static pack_job		*finish_head, **finish_tail = &finish_head;
+static int		finish_pending;	/* queued or being finished */
+
+static void
+pack_error (char *name)
+{
+    fprintf (stderr, "%s: %s\n", name, strerror (errno));
+    exit (1);
+}
+
+static uint32_t
+pack_bucket (const unsigned char *sha1)
+{
+    return ((uint32_t) sha1[0] << 24 | sha1[1] << 16 |
+	    sha1[2] << 8 | sha1[3]) & (pack_nhash - 1);
+}
+
+static pack_object *
+pack_find (const unsigned char *sha1)
+{
+    uint32_t	i;
+    pack_object	*o;
+
+    if (!pack_nhash)
+	return NULL;
+    for (i = pack_bucket (sha1); pack_hash[i]; i = (i + 1) & (pack_nhash - 1)) {
+	o = &pack_objects[pack_hash[i] - 1];
+	if (!memcmp (o->sha1, sha1, 20))
+	    return o;
+    }
+    return NULL;
+}
+
+static void
+pack_insert (uint32_t n)
+{
+    uint32_t	i;
+
+    for (i = pack_bucket (pack_objects[n].sha1); pack_hash[i];
+	 i = (i + 1) & (pack_nhash - 1))
+	;
+    pack_hash[i] = n + 1;
+}
+
+static pack_object *
+pack_add (const unsigned char *sha1)
+{
+    uint32_t	n;
+
+    if (pack_nobjects == pack_maxobjects) {
+	pack_maxobjects = pack_maxobjects ? pack_maxobjects * 2 : 1024;
+	pack_objects = realloc (pack_objects,
+				pack_maxobjects * sizeof (pack_object));
+	if (!pack_objects)
+	    pack_error ("pack objects");
+    }
+    memcpy (pack_objects[pack_nobjects].sha1, sha1, 20);
+    pack_nobjects++;
+    if (pack_nobjects * 2 > pack_nhash) {
+	free (pack_hash);
+	pack_nhash = pack_nhash ? pack_nhash * 2 : 1024;
+	pack_hash = calloc (pack_nhash, sizeof (uint32_t));
+	if (!pack_hash)
+	    pack_error ("pack objects");
+	for (n = 0; n < pack_nobjects; n++)
+	    pack_insert (n);
+    } else
+	pack_insert (pack_nobjects - 1);
+    return &pack_objects[pack_nobjects - 1];
+}
+
+static void
+pack_write (const void *data, size_t len)
+{
+    if (fwrite (data, 1, len, pack_file) != len)
+	pack_error (pack_tmp);
+    pack_offset += len;
+}
+
+static void
+pack_begin (void)
+{
+    char	    *dir = git_pack_directory ();
+    int		    fd;
+    uint32_t	    header[3];
+
+    if (!dir)
+	exit (1);
+    pack_tmp = git_format_command ("%s/tmp_pack_XXXXXX", dir);
+    if (!pack_tmp)
+	exit (1);
+    fd = mkstemp (pack_tmp);
+    if (fd < 0 || fchmod (fd, 0444) < 0 || !(pack_file = fdopen (fd, "w+")))
+	pack_error (pack_tmp);
+    pack_offset = 0;
+    pack_first = pack_nobjects;
+    /* the object count is filled in by pack_finish */
+    memcpy (header, "PACK", 4);
+    header[1] = htonl (2);
+    header[2] = 0;
+    pack_write (header, sizeof (header));
+}
+
+/*
+ * Append one entry: the type and inflated size, for deltas the
+ * distance back to the base, then the deflated data
+ */
+static void
+pack_entry (int type, unsigned long size, off_t base,
+	    const void *data, unsigned long len)
+{
+    unsigned char   header[32];
+    int		    n = 0, i;
+    uLongf	    zlen;
+    off_t	    ofs;
+
+    header[n++] = (type << 4) | (size & 15);
+    for (size >>= 4; size; size >>= 7) {
+	header[n - 1] |= 0x80;
+	header[n++] = size & 0x7f;
+    }
+    if (type == OBJ_OFS_DELTA) {
+	ofs = pack_offset - base;
+	i = sizeof (header) - 1;
+	header[i] = ofs & 0x7f;
+	while (ofs >>= 7)
+	    header[--i] = 0x80 | (--ofs & 0x7f);
+	memmove (header + n, header + i, sizeof (header) - i);
+	n += sizeof (header) - i;
+    }
+    zlen = compressBound (len);
+    if (zlen > pack_zsize) {
+	pack_zsize = zlen;
+	pack_zbuf = realloc (pack_zbuf, pack_zsize);
+    }
+    if (compress2 (pack_zbuf, &zlen, data, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+	fprintf (stderr, "%s: deflate failed\n", pack_tmp);
+	exit (1);
+    }
+    pack_write (header, n);
+    pack_write (pack_zbuf, zlen);
+}
+
+static int
+pack_index_cmp (const void *a, const void *b)
+{
+    return memcmp (((pack_object *) a)->sha1, ((pack_object *) b)->sha1, 20);
+}
+
+/*
+ * Patch the object count into the header and append the checksum
+ * of the whole file, then write a version 1 index for it
+ */
+static void
+pack_finish (pack_job *job)
+{
+    char	    *dir = git_pack_directory ();
+    unsigned char   buf[65536], sha1[20];
+    uint32_t	    count = job->count;
+    pack_object	    *objects = job->objects;
+    uint32_t	    fanout[256], offset, n;
+    char	    name[41], *idx_tmp, *pack_name, *idx_name;
+    FILE	    *idx;
+    SHA_CTX	    ctx;
+    size_t	    len;
+    int		    i;
+
+    offset = htonl (count);
+    if (fseeko (job->file, 8, SEEK_SET) != 0 ||
+	fwrite (&offset, 4, 1, job->file) != 1 ||
+	fseeko (job->file, 0, SEEK_SET) != 0)
+	pack_error (job->tmp);
+    SHA1_Init (&ctx);
+    while ((len = fread (buf, 1, sizeof (buf), job->file)) > 0)
+	SHA1_Update (&ctx, buf, len);
+    if (ferror (job->file))
+	pack_error (job->tmp);
+    SHA1_Final (sha1, &ctx);
+    if (fseeko (job->file, 0, SEEK_END) != 0 ||
+	fwrite (sha1, 20, 1, job->file) != 1 ||
+	fclose (job->file) == EOF)
+	pack_error (job->tmp);
+
+    idx_tmp = git_format_command ("%s/tmp_idx_XXXXXX", dir);
+    if (!idx_tmp)
+	exit (1);
+    i = mkstemp (idx_tmp);
+    if (i < 0 || fchmod (i, 0444) < 0 || !(idx = fdopen (i, "w")))
+	pack_error (idx_tmp);
+    qsort (objects, count, sizeof (pack_object), pack_index_cmp);
+    memset (fanout, 0, sizeof (fanout));
+    for (n = 0; n < count; n++)
+	fanout[objects[n].sha1[0]]++;
+    for (i = 1; i < 256; i++)
+	fanout[i] += fanout[i - 1];
+    for (i = 0; i < 256; i++)
+	fanout[i] = htonl (fanout[i]);
+    SHA1_Init (&ctx);
+    fwrite (fanout, sizeof (fanout), 1, idx);
+    SHA1_Update (&ctx, fanout, sizeof (fanout));
+    for (n = 0; n < count; n++) {
+	offset = htonl (objects[n].offset);
+	fwrite (&offset, 4, 1, idx);
+	fwrite (objects[n].sha1, 20, 1, idx);
+	SHA1_Update (&ctx, &offset, 4);
+	SHA1_Update (&ctx, objects[n].sha1, 20);
+    }
+    fwrite (sha1, 20, 1, idx);
+    SHA1_Update (&ctx, sha1, 20);
+    SHA1_Final (buf, &ctx);
+    fwrite (buf, 20, 1, idx);
+    if (ferror (idx) || fclose (idx) == EOF)
+	pack_error (idx_tmp);
+
+    /* sha1_to_hex has one buffer, which the committer is using */
+    for (i = 0; i < 20; i++)
+	sprintf (name + 2 * i, "%02x", sha1[i]);
+    pack_name = git_format_command ("%s/pack-%s.pack", dir, name);
+    idx_name = git_format_command ("%s/pack-%s.idx", dir, name);
+    if (!pack_name || !idx_name)
+	exit (1);
+    if (rename (job->tmp, pack_name) == -1)
+	pack_error (pack_name);
+    if (rename (idx_tmp, idx_name) == -1)
+	pack_error (idx_name);
+    free (pack_name);
+    free (idx_name);
+    free (idx_tmp);
+
+    git_lock_objects ();
+    reprepare_packed_git ();
+    git_unlock_objects ();
+}
+
+static void *
+pack_finisher (void *closure)
+{
+    pack_job	*job;
+
+    for (;;) {
+	pthread_mutex_lock (&finish_mutex);
+	while (!finish_head)
+	    pthread_cond_wait (&finish_work, &finish_mutex);
+	job = finish_head;
+	finish_head = job->next;
+	if (!finish_head)
+	    finish_tail = &finish_head;
+	pthread_mutex_unlock (&finish_mutex);
+
+	pack_finish (job);
+	free (job->objects);
+	free (job->tmp);
+	free (job);
+
+	pthread_mutex_lock (&finish_mutex);
+	finish_pending--;
+	pthread_cond_broadcast (&finish_done);
+	pthread_mutex_unlock (&finish_mutex);
+    }
+    return NULL;
+}
+
+static void
+pack_finish_start (void)
+{
+    pthread_t	finisher;
+
+    errno = pthread_create (&finisher, NULL, pack_finisher, NULL);
+    if (errno)
+	pack_error ("pthread_create");
+    pthread_detach (finisher);
+}
+
+/*
+ * Hand the current pack to the finisher, with a copy of its part of
+ * the object table as the table keeps growing. Called with pack_mutex
+ * held; the next object stored starts a new pack.
+ */
+static void
+pack_close (void)
+{
+    pack_job	*job = calloc (1, sizeof (pack_job));
+
+    if (!job)
+	pack_error ("pack objects");
+    job->file = pack_file;
+    job->tmp = pack_tmp;
+    job->count = pack_nobjects - pack_first;
+    job->objects = malloc (job->count * sizeof (pack_object) + 1);
+    if (!job->objects)
+	pack_error ("pack objects");
+    memcpy (job->objects, pack_objects + pack_first,
+	    job->count * sizeof (pack_object));
+    pack_file = NULL;
+    pack_tmp = NULL;
+
+    pthread_once (&finish_once, pack_finish_start);
+    pthread_mutex_lock (&finish_mutex);
+    while (finish_pending >= PACK_FINISH_QUEUE)
+	pthread_cond_wait (&finish_done, &finish_mutex);
+    finish_pending++;
+    *finish_tail = job;
+    finish_tail = &job->next;
+    pthread_cond_signal (&finish_work);
+    pthread_mutex_unlock (&finish_mutex);
+}
+
+static int
+pack_type (const char *type)
+{
+    if (!strcmp (type, "blob"))
+	return OBJ_BLOB;
+    if (!strcmp (type, "tree"))
+	return OBJ_TREE;
+    if (!strcmp (type, "commit"))
+	return OBJ_COMMIT;
+    if (!strcmp (type, "tag"))
+	return OBJ_TAG;
+    fprintf (stderr, "unknown object type %s\n", type);
+    exit (1);
+}
+
+/*
+ * Store an object, returning its name in SHA1. When BASE names an
+ * object earlier in the current pack, DELTA turns that object into
+ * this one and is stored in place of the data.
+ */
+static void
+pack_store (const char *type, void *buf, unsigned long len,
+	    const unsigned char *base, void *delta, unsigned long delta_len,
+	    unsigned char *sha1)
+{
+    char	    header[64];
+    SHA_CTX	    ctx;
+    pack_object	    *o, *b = NULL;
+    uint32_t	    base_offset = 0, depth = 0;
+
+    SHA1_Init (&ctx);
+    SHA1_Update (&ctx, header, sprintf (header, "%s %lu", type, len) + 1);
+    SHA1_Update (&ctx, buf, len);
+    SHA1_Final (sha1, &ctx);
+
+    pthread_mutex_lock (&pack_mutex);
+    if (pack_find (sha1)) {
+	pthread_mutex_unlock (&pack_mutex);
+	return;
+    }
+    if (!pack_file)
+	pack_begin ();
+    if (base && delta && delta_len < len)
+	b = pack_find (base);
+    if (b && b >= pack_objects + pack_first && b->depth < PACK_DELTA_DEPTH) {
+	base_offset = b->offset;
+	depth = b->depth + 1;
+    }
+    /* may move the table, and b with it */
+    o = pack_add (sha1);
+    o->offset = pack_offset;
+    o->depth = depth;
+    if (depth)
+	pack_entry (OBJ_OFS_DELTA, delta_len, base_offset, delta, delta_len);
+    else
+	pack_entry (pack_type (type), len, 0, buf, len);
+    if (pack_offset >= PACK_SIZE_LIMIT ||
+	(pack_max_bytes && pack_offset >= pack_max_bytes))
+	pack_close ();
+    pthread_mutex_unlock (&pack_mutex);
+}
+
+/* Used in place of write_sha1_file */
+int
+pack_sha1_file (void *buf, unsigned long len, const char *type,
+		unsigned char *sha1)
+{
+    pack_store (type, buf, len, NULL, NULL, 0, sha1);
+    return 0;
+}
+
+void
+pack_blob (void *text, unsigned long len, const unsigned char *base,
+	   void *delta, unsigned long delta_len, unsigned char *sha1)
+{
+    pack_store ("blob", text, len, base, delta, delta_len, sha1);
+}
+
+/* Make everything stored so far visible to git */
+void
+pack_flush (void)
+{
+    pthread_mutex_lock (&pack_mutex);
+    if (pack_file)
+	pack_close ();
+    pthread_mutex_unlock (&pack_mutex);
+    pthread_mutex_lock (&finish_mutex);
+    while (finish_pending)
+	pthread_cond_wait (&finish_done, &finish_mutex);
+    pthread_mutex_unlock (&finish_mutex);
+}
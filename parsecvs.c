@@ -21,13 +21,12 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #ifndef MAXPATHLEN
 #define MAXPATHLEN  10240
 #endif
 
-cvs_file	*this_file;
-
 rev_execution_mode rev_mode = ExecuteGit;
 
 int elide = 0;
@@ -102,7 +101,7 @@ dump_patches (char *name, cvs_patch *patches)
     while (patches) {
 	dump_number ("\tnumber: ", &patches->number); printf ("\n");
 	printf ("\t\tlog: %d bytes\n", (int)strlen (patches->log));
-	printf ("\t\ttext: %d bytes\n", (int)strlen (patches->text));
+	printf ("\t\ttext: %d bytes\n", (int) patches->text.length);
 	patches = patches->next;
     }
 }
@@ -473,36 +472,59 @@ dump_rev_list (rev_list *rl)
     }
 }
 
-extern FILE *yyin;
 static int err = 0;
-char *yyfilename;
-extern int yylineno;
 
-static rev_list *
-rev_list_file (char *name, int *nversions)
+static cvs_context *
+rev_parse_file (char *name)
 {
-    rev_list	*rl;
+    cvs_context	*ctx = calloc (1, sizeof (cvs_context));
     struct stat	buf;
 
-    yyin = fopen (name, "r");
-    if (!yyin) {
+    if (cvs_input_open (&ctx->input, name, &buf) < 0) {
 	perror (name);
-	++err;
-    }
-    yyfilename = name;
-    yylineno = 0;
-    this_file = calloc (1, sizeof (cvs_file));
-    this_file->name = name;
-    if (yyin)
-	assert (fstat (fileno (yyin), &buf) == 0);
-    this_file->mode = buf.st_mode;
-    yyparse ();
-    fclose (yyin);
-    yyfilename = 0;
-    rl = rev_list_cvs (this_file);
-	    
-    *nversions = this_file->nversions;
-    cvs_file_free (this_file);
+	ctx->error = 1;
+	buf.st_mode = 0;
+    }
+    ctx->nodes.arena = &ctx->arena;
+    ctx->file = cvs_arena_alloc (&ctx->arena, sizeof (cvs_file));
+    ctx->file->name = name;
+    ctx->file->mode = buf.st_mode;
+    if (rcs_parser_fast)
+	rcs_parse (ctx);
+    else {
+	if (lex_init (ctx) < 0) {
+	    perror (name);
+	    exit (1);
+	}
+	yyparse (ctx, ctx->scanner);
+	lex_fini (ctx);
+    }
+    return ctx;
+}
+
+static void
+rev_free_file (cvs_context *ctx)
+{
+    cvs_arena_free (&ctx->arena);
+    /* patch text points into the input until the blobs are written */
+    cvs_input_close (&ctx->input);
+    free (ctx);
+}
+
+/*
+ * Convert one ,v file. All of the parse and checkout state lives
+ * in the context, so this may run for several files at once
+ */
+static rev_list *
+rev_list_file (char *name, int *nversions, int *error)
+{
+    cvs_context	*ctx = rev_parse_file (name);
+    rev_list	*rl;
+
+    rl = rev_list_cvs (ctx);
+    *nversions = ctx->file->nversions;
+    *error = ctx->error;
+    rev_free_file (ctx);
     return rl;
 }
 
@@ -729,6 +751,10 @@ strcommon (char *a, char *b)
 typedef struct _rev_filename {
     struct _rev_filename	*next;
     char		*file;
+    rev_list		*rl;
+    int			nversions;
+    int			error;
+    int			done;
 } rev_filename;
 
 #define STATUS	stdout
@@ -761,8 +787,381 @@ static void load_status_next (void)
     fflush (STATUS);
 }
 
+/*
+ * Parse every file once, returning the number of bytes read
+ */
+static double
+bench_parse_pass (rev_filename *fn_head, int *nfile)
+{
+    rev_filename    *fn;
+    cvs_context	    *ctx;
+    double	    bytes = 0;
+
+    *nfile = 0;
+    for (fn = fn_head; fn; fn = fn->next) {
+	ctx = rev_parse_file (fn->file);
+	err += ctx->error;
+	bytes += ctx->input.end - ctx->input.base;
+	rev_free_file (ctx);
+	(*nfile)++;
+    }
+    return bytes;
+}
+
+/*
+ * Measure raw parse throughput, comparing mapped input against
+ * buffered reads and the built-in parser against yacc. The buffered
+ * reads are the fallback that replaced the old getc input, and
+ * stand in for it here. An untimed pass first brings the files into
+ * the page cache, so no mode pays for reading the disk.
+ */
+static void
+bench_parse (rev_filename *fn_head)
+{
+    static const struct {
+	char	*name;
+	int	mmap;
+	int	fast;
+    } modes[] = {
+	{ "read/yacc", 0, 0 },
+	{ "mmap/yacc", 1, 0 },
+	{ "mmap/fast", 1, 1 },
+    };
+    struct timeval  start, stop;
+    double	    bytes, secs;
+    int		    m, nfile;
+    int		    fast = rcs_parser_fast;
+
+    cvs_input_mmap = 1;
+    rcs_parser_fast = 1;
+    (void) bench_parse_pass (fn_head, &nfile);
+    for (m = 0; m < sizeof (modes) / sizeof (modes[0]); m++) {
+	cvs_input_mmap = modes[m].mmap;
+	rcs_parser_fast = modes[m].fast;
+	gettimeofday (&start, NULL);
+	bytes = bench_parse_pass (fn_head, &nfile);
+	gettimeofday (&stop, NULL);
+	secs = (stop.tv_sec - start.tv_sec) +
+	       (stop.tv_usec - start.tv_usec) / 1e6;
+	fprintf (STATUS, "Parse (%s): %d files, %.1f MB in %.3fs, %.1f MB/s\n",
+		 modes[m].name, nfile, bytes / 1e6, secs,
+		 secs > 0 ? bytes / 1e6 / secs : 0);
+    }
+    cvs_input_mmap = 1;
+    rcs_parser_fast = fast;
+}
+
+/*
+ * Write a ,v file with nbranch branches off 1.1, each with one
+ * revision and a symbol, returning its name
+ */
+static char *
+bench_branches_file (int nbranch)
+{
+    char    *name = strdup ("/tmp/parsecvs-branches-XXXXXX");
+    int	    fd = mkstemp (name);
+    FILE    *f;
+    int	    b;
+
+    if (fd < 0 || !(f = fdopen (fd, "w"))) {
+	perror (name);
+	exit (1);
+    }
+    fprintf (f, "head\t1.2;\naccess;\nsymbols");
+    for (b = 0; b < nbranch; b++)
+	fprintf (f, "\n\tbranch-%d:1.1.0.%d", b, b * 2 + 2);
+    fprintf (f, ";\nlocks; strict;\n\n");
+    fprintf (f, "1.2\ndate\t2006.01.01.00.00.00;\tauthor bench;\tstate Exp;\n"
+	     "branches;\nnext\t1.1;\n\n");
+    fprintf (f, "1.1\ndate\t2005.01.01.00.00.00;\tauthor bench;\tstate Exp;\n"
+	     "branches");
+    for (b = 0; b < nbranch; b++)
+	fprintf (f, "\n\t1.1.%d.1", b * 2 + 2);
+    fprintf (f, ";\nnext\t;\n\n");
+    for (b = 0; b < nbranch; b++)
+	fprintf (f, "1.1.%d.1\ndate\t2005.06.01.00.00.00;\tauthor bench;\t"
+		 "state Exp;\nbranches;\nnext\t;\n\n", b * 2 + 2);
+    fprintf (f, "\ndesc\n@@\n\n1.2\nlog\n@head@\ntext\n@head\n@\n\n"
+	     "1.1\nlog\n@base@\ntext\n@d1 1\na1 1\nbase\n@\n");
+    for (b = 0; b < nbranch; b++)
+	fprintf (f, "\n1.1.%d.1\nlog\n@branch@\ntext\n@d1 1\na1 1\nbranch\n@\n",
+		 b * 2 + 2);
+    if (fclose (f) != 0) {
+	perror (name);
+	exit (1);
+    }
+    return name;
+}
+
+/*
+ * Time building the history of files with many branch symbols,
+ * where attaching names to heads used to search every head
+ */
+static void
+bench_branches (rev_filename *fn_head)
+{
+    static const int	sizes[] = { 1000, 10000 };
+    cvs_context		*ctx;
+    struct timeval	start, stop;
+    double		secs;
+    char		*name;
+    int			i;
+
+    for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+	name = bench_branches_file (sizes[i]);
+	ctx = rev_parse_file (name);
+	ctx->skip_blobs = 1;
+	gettimeofday (&start, NULL);
+	rev_list_cvs (ctx);
+	gettimeofday (&stop, NULL);
+	secs = (stop.tv_sec - start.tv_sec) +
+	       (stop.tv_usec - start.tv_usec) / 1e6;
+	fprintf (STATUS, "Branches: %d symbols, %d versions, history in %.3fs\n",
+		 sizes[i], ctx->file->nversions, secs);
+	rev_free_file (ctx);
+	unlink (name);
+	free (name);
+    }
+}
+
+/*
+ * A file with a large head revision and a run of small trunk
+ * changes, with a keyword and an @ every so often
+ */
+static char *
+bench_blobs_file (char *expand, int nlines, int nrevs)
+{
+    char    *name = strdup ("/tmp/parsecvs-blobs-XXXXXX");
+    int	    fd = mkstemp (name);
+    FILE    *f;
+    int	    r, l;
+
+    if (fd < 0 || !(f = fdopen (fd, "w"))) {
+	perror (name);
+	exit (1);
+    }
+    fprintf (f, "head\t1.%d;\naccess;\nsymbols;\nlocks; strict;\n", nrevs);
+    if (expand)
+	fprintf (f, "expand\t@%s@;\n", expand);
+    fprintf (f, "\n");
+    for (r = nrevs; r >= 1; r--) {
+	fprintf (f, "1.%d\ndate\t2006.01.01.00.00.%02d;\tauthor bench;\t"
+		 "state Exp;\nbranches;\nnext\t", r, r % 60);
+	if (r > 1)
+	    fprintf (f, "1.%d", r - 1);
+	fprintf (f, ";\n\n");
+    }
+    fprintf (f, "\ndesc\n@@\n\n1.%d\nlog\n@head@\ntext\n@", nrevs);
+    for (l = 1; l <= nlines; l++) {
+	if (l % 1000 == 0)
+	    fprintf (f, "/* $Id$ */\n");
+	else if (l % 500 == 0)
+	    fprintf (f, "    mail@@example.com line %d\n", l);
+	else
+	    fprintf (f, "    benchmark_line (%d, \"some text\");\n", l);
+    }
+    fprintf (f, "@\n");
+    for (r = nrevs - 1; r >= 1; r--) {
+	l = (r * 97) % nlines + 1;
+	fprintf (f, "\n\n1.%d\nlog\n@change@\ntext\n@d%d 1\na%d 1\n"
+		 "    changed_line (%d);\n@\n", r, l, l, r);
+    }
+    if (fclose (f) != 0) {
+	perror (name);
+	exit (1);
+    }
+    return name;
+}
+
+/*
+ * Time checking out every revision of a file with a large head,
+ * with and without keyword expansion, leaving the blobs unstored
+ */
+static void
+bench_blobs (rev_filename *fn_head)
+{
+    static const struct {
+	char	*name;
+	char	*expand;
+    } modes[] = {
+	{ "kv", "kv" },
+	{ "o", "o" },
+	{ "b", "b" },
+    };
+    const int		nlines = 100000, nrevs = 50;
+    cvs_context		*ctx;
+    struct timeval	start, stop;
+    double		secs;
+    unsigned long	bytes;
+    char		*name;
+    int			m;
+
+    for (m = 0; m < sizeof (modes) / sizeof (modes[0]); m++) {
+	name = bench_blobs_file (modes[m].expand, nlines, nrevs);
+	ctx = rev_parse_file (name);
+	ctx->skip_blobs = 1;
+	rev_list_cvs (ctx);
+	gettimeofday (&start, NULL);
+	bytes = generate_files (ctx, 0);
+	gettimeofday (&stop, NULL);
+	secs = (stop.tv_sec - start.tv_sec) +
+	       (stop.tv_usec - start.tv_usec) / 1e6;
+	fprintf (STATUS, "Blobs (-k%s): %d blobs, %.1f MB in %.3fs, "
+		 "%.0f blobs/s, %.1f MB/s\n",
+		 modes[m].name, nrevs, bytes / 1e6, secs,
+		 secs > 0 ? nrevs / secs : 0,
+		 secs > 0 ? bytes / 1e6 / secs : 0);
+	rev_free_file (ctx);
+	unlink (name);
+	free (name);
+    }
+}
+
+/*
+ * Files are loaded by a pool of worker threads, each taking the
+ * next file from the input list. main() collects the results in
+ * list order, so everything after the load sees the same sequence
+ * of rev_lists however many workers there are.
+ */
+static int		load_jobs = 1;
+static rev_filename	*load_next;
+static pthread_mutex_t	load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	load_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+load_file (rev_filename *fn)
+{
+    fn->rl = rev_list_file (fn->file, &fn->nversions, &fn->error);
+}
+
+static void *
+load_worker (void *closure)
+{
+    rev_filename    *fn;
+
+    for (;;) {
+	pthread_mutex_lock (&load_mutex);
+	fn = load_next;
+	if (fn)
+	    load_next = fn->next;
+	pthread_mutex_unlock (&load_mutex);
+	if (!fn)
+	    break;
+	load_file (fn);
+	pthread_mutex_lock (&load_mutex);
+	fn->done = 1;
+	pthread_cond_broadcast (&load_cond);
+	pthread_mutex_unlock (&load_mutex);
+    }
+    return NULL;
+}
+
+static pthread_t *
+load_start (rev_filename *fn_head)
+{
+    pthread_t	*workers;
+    int		i;
+
+    if (load_jobs <= 1)
+	return NULL;
+    load_next = fn_head;
+    workers = calloc (load_jobs, sizeof (pthread_t));
+    for (i = 0; i < load_jobs; i++)
+	if (pthread_create (&workers[i], NULL, load_worker, NULL) != 0) {
+	    perror ("pthread_create");
+	    exit (1);
+	}
+    return workers;
+}
+
+/*
+ * Return once fn has been loaded, loading it here when there
+ * are no workers
+ */
+static void
+load_wait (rev_filename *fn)
+{
+    if (load_jobs <= 1) {
+	load_file (fn);
+	return;
+    }
+    pthread_mutex_lock (&load_mutex);
+    while (!fn->done)
+	pthread_cond_wait (&load_cond, &load_mutex);
+    pthread_mutex_unlock (&load_mutex);
+}
+
+static void
+load_finish (pthread_t *workers)
+{
+    int	i;
+
+    if (!workers)
+	return;
+    for (i = 0; i < load_jobs; i++)
+	pthread_join (workers[i], NULL);
+    free (workers);
+}
+
+static void *
+bench_atom_worker (void *closure)
+{
+    rev_filename    *fn;
+
+    for (;;) {
+	pthread_mutex_lock (&load_mutex);
+	fn = load_next;
+	if (fn)
+	    load_next = fn->next;
+	pthread_mutex_unlock (&load_mutex);
+	if (!fn)
+	    break;
+	rev_free_file (rev_parse_file (fn->file));
+    }
+    return NULL;
+}
+
+/*
+ * Parse every file with --jobs threads, all interning names into
+ * the shared atom table, and report how the table held up
+ */
+static void
+bench_atom (rev_filename *fn_head)
+{
+    pthread_t	    *workers;
+    struct timeval  start, stop;
+    double	    secs;
+    int		    i;
+
+    workers = calloc (load_jobs, sizeof (pthread_t));
+    load_next = fn_head;
+    gettimeofday (&start, NULL);
+    for (i = 0; i < load_jobs; i++)
+	if (pthread_create (&workers[i], NULL, bench_atom_worker, NULL) != 0) {
+	    perror ("pthread_create");
+	    exit (1);
+	}
+    for (i = 0; i < load_jobs; i++)
+	pthread_join (workers[i], NULL);
+    gettimeofday (&stop, NULL);
+    free (workers);
+    secs = (stop.tv_sec - start.tv_sec) +
+	   (stop.tv_usec - start.tv_usec) / 1e6;
+    fprintf (STATUS, "Atom: %d jobs, parsed in %.3fs\n", load_jobs, secs);
+    atom_stats (STATUS);
+}
+
+static const struct {
+    char    *name;
+    void    (*run) (rev_filename *fn_head);
+} benchmarks[] = {
+    { "parse", bench_parse },
+    { "atom", bench_atom },
+    { "branches", bench_branches },
+    { "blobs", bench_blobs },
+};
+
 int commit_time_window = 60;
-static int obj_pack_time = 0;
 
 int
 main (int argc, char **argv)
@@ -776,8 +1175,8 @@ main (int argc, char **argv)
     int		    c;
     char	    *file;
     int		    nfile = 0;
-    rev_list	    *pack_start = NULL;
-    int		    pack_objcount = 0;
+    int		    benchmark = -1;
+    pthread_t	    *workers;
 
     while (1) {
 	static struct option options[] = {
@@ -786,8 +1185,13 @@ main (int argc, char **argv)
 	    { "commit-time-window", 1, 0, 'w' },
             { "log-command",        1, 0, 'l' },
             { "autopack",           1, 0, 'p' },
+	    { "benchmark",	    1, 0, 'b' },
+	    { "pack-deltas",	    0, 0, 'd' },
+	    { "fast-parser",	    0, 0, 'f' },
+	    { "jobs",		    1, 0, 'j' },
+	    { 0,		    0, 0, 0 },
 	};
-	int c = getopt_long(argc, argv, "+hVw:l:p:", options, NULL);
+	int c = getopt_long(argc, argv, "+hVw:l:p:b:dfj:", options, NULL);
 	if (c < 0)
 	    break;
 	switch (c) {
@@ -795,20 +1199,49 @@ main (int argc, char **argv)
 	    printf("Usage: parsecvs [OPTIONS] [FILE]...\n"
 		   "Parse RCS files and populate git repository.\n\n"
                    "Mandatory arguments to long options are mandatory for short options too.\n"
+                   " -b --benchmark=KIND             Run parse, atom, branches or blobs benchmark\n"
+                   " -d --pack-deltas                Write blobs to packs as deltas between revisions\n"
+                   " -f --fast-parser                Use the built-in RCS parser instead of yacc\n"
                    " -h --help                       This help\n"
+                   " -j --jobs=NUM                   Load NUM files, and their branches, in parallel\n"
                    " -l --log-command=COMMAND        Call COMMAND to handle changelogs\n"
-                   " -p --autopack=NUM               Auto-pack for every NUM objects. 0 disables.\n"
+                   " -p --autopack=SIZE              Start a new pack every SIZE megabytes. 0 disables.\n"
 
                    " -v --version                    Print version\n"
                    " -w --commit-time-window=WINDOW  Time window for commits\n\n"
-		   "Example: find -name '*,v' | parsecvs -l edit-change-log -p 1024\n");
+		   "Example: find -name '*,v' | parsecvs -l edit-change-log\n");
 	    return 0;
         case 'l':
             log_command = strdup (optarg);
             break;
         case 'p':
-            obj_pack_time = atoi (optarg);
+            pack_max_bytes = strtoul (optarg, NULL, 0) << 20;
             break;
+	case 'd':
+	    pack_deltas = 1;
+	    break;
+	case 'f':
+	    rcs_parser_fast = 1;
+	    break;
+	case 'j':
+	    load_jobs = atoi (optarg);
+	    if (load_jobs < 1) {
+		fprintf (stderr, "%s: invalid job count '%s'\n", argv[0], optarg);
+		return 1;
+	    }
+	    checkout_jobs = load_jobs;
+	    break;
+	case 'b':
+	    for (benchmark = 0;
+		 benchmark < sizeof (benchmarks) / sizeof (benchmarks[0]);
+		 benchmark++)
+		if (!strcmp (optarg, benchmarks[benchmark].name))
+		    break;
+	    if (benchmark == sizeof (benchmarks) / sizeof (benchmarks[0])) {
+		fprintf (stderr, "%s: unknown benchmark '%s'\n", argv[0], optarg);
+		return 1;
+	    }
+	    break;
 	case 'V':
 	    printf("parsecvs version 0.1\n"
 		   "\n"
@@ -866,44 +1299,32 @@ main (int argc, char **argv)
 	last = fn->file;
 	nfile++;
     }
+    if (benchmark >= 0) {
+	benchmarks[benchmark].run (fn_head);
+	return err;
+    }
     if (git_system ("git init") != 0)
 	exit (1);
     load_total_files = nfile;
     load_current_file = 0;
+    workers = load_start (fn_head);
     while (fn_head) {
-	int nversions;
-	
 	fn = fn_head;
 	fn_head = fn_head->next;
 	++load_current_file;
 	load_status (fn->file + strip);
-	rl = rev_list_file (fn->file, &nversions);
+	load_wait (fn);
+	rl = fn->rl;
+	err += fn->error;
+	rev_list_tag_commits (rl);
 	if (rl->watch)
 	    dump_rev_tree (rl);
 	*tail = rl;
 	tail = &rl->next;
 
-	if (rev_mode == ExecuteGit && obj_pack_time)
-	{
-	    /*
-	     * Pack objects on occasion to reduce .git directory
-	     * cost
-	     */
-	    if (!pack_start)
-		pack_start = rl;
-	    pack_objcount += nversions;
-	    if (pack_objcount > obj_pack_time)
-	    {
-		git_rev_list_pack (pack_start, strip);
-		pack_start = NULL;
-		pack_objcount = 0;
-	    }
-	}
-
 	free(fn);
     }
-    if (rev_mode == ExecuteGit && pack_objcount && obj_pack_time)
-	git_rev_list_pack (pack_start, strip);
+    load_finish (workers);
     load_status_next ();
     init_tree(strip);
     rl = rev_list_merge (head);
@@ -26,6 +26,7 @@
  */
 #include <limits.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "cvs.h"
 
 typedef unsigned char uchar;
@@ -45,8 +46,32 @@ struct in_buffer_type {
 	int read_count;
 };
 
-struct diffcmd {
-	long line1, nlines, adprev, dafter;
+/*
+ * A line of a revision, as a pointer into the delta text that added
+ * it. Any @s in lines are duplicated; LEN runs through the \n, or for
+ * a last partial line only, up to the closing @.
+ */
+struct rcs_line {
+	uchar *text;
+	size_t len;
+};
+
+/*
+ * A delta's edit commands, decoded in one pass over its text: each
+ * op is an 'a' or 'd' command, and an 'a' takes its nlines lines from
+ * line[first] on.
+ */
+struct delta_op {
+	int cmd;
+	long line1, nlines;
+	size_t first;
+};
+
+struct delta_script {
+	struct delta_op *op;
+	size_t nops, maxops;
+	struct rcs_line *line;
+	size_t nlines, maxlines;
 };
 
 const int initial_out_buffer_size = 1024;
@@ -68,37 +93,123 @@ enum markers { Nomatch, Author, Date, Header, Id, Locker, Log,
 enum stringwork {ENTER, EDIT};
 
 enum expand_mode {EXPANDKKV, EXPANDKKVL, EXPANDKK, EXPANDKV, EXPANDKO, EXPANDKB};
-enum expand_mode Gexpand;
-char * Glog;
-int Gkvlen = 0;
-char* Gkeyval = NULL;
-char const *Gfilename;
-char *Gabspath;
-cvs_version *Gversion;
-char Gversion_number[CVS_MAX_REV_LEN];
-struct out_buffer_type *Goutbuf;
-struct in_buffer_type in_buffer_store;
-struct in_buffer_type *Ginbuf = &in_buffer_store;
 
 /*
- * Gline contains pointers to the lines in the currently edit buffer
- * It is a 0-origin array that represents Glinemax-Ggapsize lines.
- * Gline[0 .. Ggap-1] and Gline[Ggap+Ggapsize .. Glinemax-1] hold
- * pointers to lines.  Gline[Ggap .. Ggap+Ggapsize-1] contains garbage.
- * Any @s in lines are duplicated.
- * Lines are terminated by \n, or (for a last partial line only) by single @.
+ * The lines of the revision being built are kept in chunks of up to
+ * LINE_CHUNK, listed in order by a directory. Chunks and directories
+ * are reference counted and copied only when changed while shared,
+ * so entering a branch takes another reference to its parent's
+ * directory and the branch deltas copy just the chunks they edit.
  */
-static int depth;
-static struct {
-	Node *next_branch;
-	Node *node;
-	uchar **line;
-	size_t gap, gapsize, linemax;
-} stack[CVS_MAX_DEPTH/2];
-#define Gline stack[depth].line
-#define Ggap stack[depth].gap
-#define Ggapsize stack[depth].gapsize
-#define Glinemax stack[depth].linemax
+#define LINE_CHUNK 128
+
+struct line_chunk {
+	int refs;
+	int count;
+	struct rcs_line line[LINE_CHUNK];
+};
+
+struct line_dir {
+	int refs;
+	size_t nchunks, maxchunks;
+	struct line_chunk **chunk;
+};
+
+struct line_table {
+	struct line_dir *dir;
+	size_t nlines;
+	/* deltas edit in order, so remember the last chunk used */
+	size_t cur, cur_first;
+};
+
+/*
+ * Streamed files keep each delta text's extent and, while its lines
+ * are part of the trunk revision, how many of them there are. Once
+ * that reaches zero no later revision can use the text again.
+ */
+struct delta_span {
+	uchar *start, *end;
+	long refs;
+};
+
+/*
+ * With pack_deltas set, each rendered line's offset in the blob is
+ * noted, with TEXT left null for lines whose keywords were expanded.
+ * The last revision stored on the way down to a walk's current one
+ * keeps those offsets, hashed by line, as the base for the next
+ * blob: lines the edits left alone are found there by identity and
+ * copied from it, everything else is inserted.
+ */
+struct line_mark {
+	uchar *text;
+	unsigned long off;
+};
+
+struct base_line {
+	uchar *text;
+	uint32_t off, len;
+};
+
+struct delta_base {
+	int refs;
+	rev_file *file;
+	unsigned long size;
+	unsigned long mask;
+	struct base_line *line;
+};
+
+/*
+ * What every walk over one file's revisions shares: branches off the
+ * trunk may be walked on other threads, each with its own rcs2git
+ */
+struct walk_file {
+	cvs_context *ctx;
+	enum expand_mode expand;
+	int store;
+	int pending;		/* blobs not yet written, under blob_mutex */
+	int tasks;		/* branches not yet walked, under walk_mutex */
+	unsigned long bytes;
+};
+
+/*
+ * Everything needed while walking the revisions of one file, or of
+ * one branch of it; each walk has its own, so files and branches may
+ * be processed concurrently.
+ */
+struct rcs2git {
+	struct walk_file *file;
+	int spawn;		/* hand branches off the trunk to workers */
+	int deltas;		/* build pack deltas between blobs */
+	enum expand_mode expand;
+	char *log;
+	int kvlen;
+	char *keyval;
+	char const *filename;
+	char *abspath;
+	cvs_version *version;
+	char version_number[CVS_MAX_REV_LEN];
+	struct out_buffer_type outbuf;
+	struct in_buffer_type inbuf;
+	struct delta_script script;
+	struct alloclist *unescaped;
+	cvs_input *input;
+	struct delta_span *span, *span_hint, *span_cur;
+	size_t nspans;
+	struct line_mark *mark;
+	size_t nmarks, maxmarks;
+	uchar *delta;
+	size_t ndelta, maxdelta;
+	int depth;
+	struct {
+		Node *next_branch;
+		Node *branch;
+		Node *node;
+		struct line_table lines;
+		struct delta_base *base;
+	} stack[CVS_MAX_DEPTH/2];
+};
+#define Glines g->stack[g->depth].lines
+#define Gbase g->stack[g->depth].base
 
 static void fatal_system_error(char const *s)
 {
@@ -140,134 +251,122 @@ static inline void* xrealloc(void *ptr, size_t size)
 /* backup one position in the input buffer, unless at start of buffer
  *   return character at new position, or EOF if we could not back up
  */
-static int in_buffer_ungetc(void)
+static int in_buffer_ungetc(struct rcs2git *g)
 {
 	int c;
-	if (Ginbuf->read_count == 0)
+	if (g->inbuf.read_count == 0)
 		return EOF;
-	--Ginbuf->read_count;
-	--Ginbuf->ptr;
-	c = *Ginbuf->ptr;
+	--g->inbuf.read_count;
+	--g->inbuf.ptr;
+	c = *g->inbuf.ptr;
 	if (c == SDELIM) {
-		--Ginbuf->ptr;
-		c = *Ginbuf->ptr;
+		--g->inbuf.ptr;
+		c = *g->inbuf.ptr;
 	}
 	return c;
 }
 
-static int in_buffer_getc(void)
+static int in_buffer_getc(struct rcs2git *g)
 {
 	int c;
-	c = *(Ginbuf->ptr++);
-	++Ginbuf->read_count;
+	c = *(g->inbuf.ptr++);
+	++g->inbuf.read_count;
 	if (c == SDELIM) {
-		c = *(Ginbuf->ptr++);
+		c = *(g->inbuf.ptr++);
 		if (c != SDELIM) {
-			Ginbuf->ptr -= 2;
-			--Ginbuf->read_count;
+			g->inbuf.ptr -= 2;
+			--g->inbuf.read_count;
 			return EOF;
 		}
 	}
 	return c ;
 }
 
-static uchar * in_get_line(void)
-{
-	int c;
-	uchar *ptr = Ginbuf->ptr;
-	c=in_buffer_getc();
-	if (c == EOF)
-		return NULL;
-	while (c != EOF && c != '\n')
-		c = in_buffer_getc();
-	return ptr;
-}
-
-static uchar * in_buffer_loc(void)
-{
-	return(Ginbuf->ptr);
-}
-
-static void in_buffer_init(uchar *text, int bypass_initial)
+static uchar * in_buffer_loc(struct rcs2git *g)
 {
-	Ginbuf->ptr = Ginbuf->buffer = text;
-	Ginbuf->read_count=0;
-	if (bypass_initial && *Ginbuf->ptr++ != SDELIM)
-		fatal_error("Illegal buffer, missing @ %s", text);
+	return(g->inbuf.ptr);
 }
 
-static void out_buffer_init(void)
+static void in_buffer_init(struct rcs2git *g, uchar *text)
 {
-	char *t;
-	Goutbuf = xmalloc(sizeof(struct out_buffer_type));
-	memset(Goutbuf, 0, sizeof(struct out_buffer_type));
-	Goutbuf->size = initial_out_buffer_size;
-	t = xmalloc(Goutbuf->size);
-	Goutbuf->text = t;
-	Goutbuf->ptr = t;
-	Goutbuf->end_of_text = t + Goutbuf->size;
+	g->inbuf.ptr = g->inbuf.buffer = text;
+	g->inbuf.read_count=0;
 }
 
-static void out_buffer_enlarge(void)
+/*
+ * Start a new blob. The buffer left by the last one is reused, or
+ * if that was handed off, a new one of the size it had grown to is
+ * made, so a file's blobs do not each start small and double
+ */
+static void out_buffer_init(struct rcs2git *g)
 {
-	int ptroffset = Goutbuf->ptr - Goutbuf->text;
-	Goutbuf->size *= 2;
-	Goutbuf->text = xrealloc(Goutbuf->text, Goutbuf->size);
-	Goutbuf->end_of_text = Goutbuf->text + Goutbuf->size;
-	Goutbuf->ptr = Goutbuf->text + ptroffset;
+	if (!g->outbuf.text) {
+		g->outbuf.size = max(g->outbuf.size, initial_out_buffer_size);
+		g->outbuf.text = xmalloc(g->outbuf.size);
+		g->outbuf.end_of_text = g->outbuf.text + g->outbuf.size;
+	}
+	g->outbuf.ptr = g->outbuf.text;
 }
 
-static unsigned long  out_buffer_count(void)
+static void out_buffer_enlarge(struct rcs2git *g)
 {
-	return (unsigned long) (Goutbuf->ptr - Goutbuf->text);
+	size_t ptroffset = g->outbuf.ptr - g->outbuf.text;
+	g->outbuf.size *= 2;
+	g->outbuf.text = xrealloc(g->outbuf.text, g->outbuf.size);
+	g->outbuf.end_of_text = g->outbuf.text + g->outbuf.size;
+	g->outbuf.ptr = g->outbuf.text + ptroffset;
 }
 
-static char *out_buffer_text(void)
+static unsigned long  out_buffer_count(struct rcs2git *g)
 {
-	return Goutbuf->text;
+	return (unsigned long) (g->outbuf.ptr - g->outbuf.text);
 }
 
-static void out_buffer_cleanup(void)
+/* Take the blob text; the caller must free it */
+static char *out_buffer_detach(struct rcs2git *g)
 {
-	free(Goutbuf->text);
-	free(Goutbuf);
+	char *text = g->outbuf.text;
+	g->outbuf.text = NULL;
+	return text;
 }
 
-inline static void out_putc(int c)
+inline static void out_putc(struct rcs2git *g, int c)
 {
-	*Goutbuf->ptr++ = c;
-	if (Goutbuf->ptr >= Goutbuf->end_of_text)
-		out_buffer_enlarge();
+	*g->outbuf.ptr++ = c;
+	if (g->outbuf.ptr >= g->outbuf.end_of_text)
+		out_buffer_enlarge(g);
 }
 
-static void out_printf(const char *fmt, ...)
+static void out_printf(struct rcs2git *g, const char *fmt, ...)
 {
 	int ret, room;
 	va_list ap;
 	while (1) {
-		room = Goutbuf->end_of_text - Goutbuf->ptr;
+		room = g->outbuf.end_of_text - g->outbuf.ptr;
 		va_start(ap, fmt);
-		ret = vsnprintf(Goutbuf->ptr, room, fmt, ap);
+		ret = vsnprintf(g->outbuf.ptr, room, fmt, ap);
 		va_end(ap);
 		if (ret > -1 && ret < room) {
-			Goutbuf->ptr += ret;
+			g->outbuf.ptr += ret;
 			return;
 		}
-		out_buffer_enlarge();
+		out_buffer_enlarge(g);
 	}
 }
 
-static int out_fputs(const char *s)
+static int out_fputs(struct rcs2git *g, const char *s)
 {
 	while (*s)
-		out_putc(*s++);
+		out_putc(g, *s++);
 	return 0;
 }
 
-static void out_awrite(char const *s, size_t len)
+static void out_awrite(struct rcs2git *g, char const *s, size_t len)
 {
-	while (len--)
-		out_putc(*s++);
+	while (g->outbuf.end_of_text - g->outbuf.ptr <= len)
+		out_buffer_enlarge(g);
+	memcpy(g->outbuf.ptr, s, len);
+	g->outbuf.ptr += len;
 }
 
 static int latin1_alpha(int c)
@@ -304,7 +403,7 @@ static char const * basefilename(char const *p)
 }
 
 /* Convert relative RCS filename to absolute path */
-static char const * getfullRCSname(void)
+static char const * getfullRCSname(struct rcs2git *g)
 {
 	char *wdbuf = NULL;
 	int wdbuflen = 0;
@@ -314,12 +413,12 @@ static char const * getfullRCSname(void)
 	char const *r;
 	char* d;
 
-	if (Gfilename[0] == '/')
-		return Gfilename;
+	if (g->filename[0] == '/')
+		return g->filename;
 
 	/* If we've already calculated the absolute path, return it */
-	if (Gabspath)
-		return Gabspath;
+	if (g->abspath)
+		return g->abspath;
 
 	/* Get working directory and strip any trailing slashes */
 	wdbuflen = _POSIX_PATH_MAX + 1;
@@ -336,20 +435,20 @@ static char const * getfullRCSname(void)
 		--dlen;
 	wdbuf[dlen] = 0;
 
-	/* Ignore leading `./'s in Gfilename. */
-	for (r = Gfilename;  r[0]=='.' && r[1] == '/';  r += 2)
+	/* Ignore leading `./'s in g->filename. */
+	for (r = g->filename;  r[0]=='.' && r[1] == '/';  r += 2)
 		while (r[2] == '/')
 			r++;
 
 	/* Build full pathname.  */
-	Gabspath = d = xmalloc(dlen + strlen(r) + 2);
+	g->abspath = d = xmalloc(dlen + strlen(r) + 2);
 	memcpy(d, wdbuf, dlen);
 	d += dlen;
 	*d++ = '/';
 	strcpy(d, r);
 	free(wdbuf);
 
-	return Gabspath;
+	return g->abspath;
 }
 
 /* Check if string starts with a keyword followed by a KDELIM or VDELIM */
@@ -375,110 +474,453 @@ static enum markers trymatch(char const *string)
         return(Nomatch);
 }
 
-/* Before line N, insert line L.  N is 0-origin.  */
-static void insertline(unsigned long n, uchar * l)
+static struct line_chunk *chunk_new(void)
+{
+	struct line_chunk *c = xmalloc(sizeof(struct line_chunk));
+	c->refs = 1;
+	c->count = 0;
+	return c;
+}
+
+/*
+ * Branches may be walked by other threads, so references are
+ * counted atomically. Whoever holds the only reference to a chunk
+ * or directory may change it in place; nobody else can reach it.
+ */
+static int refs_get(int *refs)
+{
+	return __atomic_load_n(refs, __ATOMIC_ACQUIRE);
+}
+
+static void refs_inc(int *refs)
+{
+	__atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+}
+
+static int refs_dec(int *refs)
+{
+	return __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL);
+}
+
+static void chunk_unref(struct line_chunk *c)
+{
+	if (refs_dec(&c->refs) == 0)
+		free(c);
+}
+
+static void dir_unref(struct line_dir *d)
+{
+	size_t i;
+
+	if (refs_dec(&d->refs) == 0) {
+		for (i = 0; i < d->nchunks; i++)
+			chunk_unref(d->chunk[i]);
+		free(d->chunk);
+		free(d);
+	}
+}
+
+static void lines_free(struct line_table *t)
+{
+	if (t->dir)
+		dir_unref(t->dir);
+	memset(t, 0, sizeof(*t));
+}
+
+/* Share t's lines with the new table n */
+static void lines_share(struct line_table *n, struct line_table *t)
+{
+	*n = *t;
+	if (n->dir)
+		refs_inc(&n->dir->refs);
+}
+
+/* Return t's directory, first copying it if it is shared */
+static struct line_dir *lines_dir(struct line_table *t)
+{
+	struct line_dir *d = t->dir, *n;
+	size_t i;
+
+	if (d && refs_get(&d->refs) == 1)
+		return d;
+	n = xmalloc(sizeof(struct line_dir));
+	n->refs = 1;
+	n->nchunks = d ? d->nchunks : 0;
+	n->maxchunks = max(n->nchunks, 16);
+	n->chunk = xmalloc(n->maxchunks * sizeof(struct line_chunk *));
+	if (d) {
+		memcpy(n->chunk, d->chunk, d->nchunks * sizeof(struct line_chunk *));
+		for (i = 0; i < d->nchunks; i++)
+			refs_inc(&d->chunk[i]->refs);
+		dir_unref(d);
+	}
+	t->dir = n;
+	return n;
+}
+
+/* Return chunk i of an unshared directory, first copying it if shared */
+static struct line_chunk *lines_chunk(struct line_dir *d, size_t i)
+{
+	struct line_chunk *c = d->chunk[i], *n;
+
+	if (refs_get(&c->refs) == 1)
+		return c;
+	n = chunk_new();
+	n->count = c->count;
+	memcpy(n->line, c->line, c->count * sizeof(struct rcs_line));
+	chunk_unref(c);
+	d->chunk[i] = n;
+	return n;
+}
+
+static void dir_insert(struct line_dir *d, size_t i, struct line_chunk *c)
+{
+	if (d->nchunks == d->maxchunks) {
+		d->maxchunks <<= 1;
+		d->chunk = xrealloc(d->chunk,
+				    d->maxchunks * sizeof(struct line_chunk *));
+	}
+	memmove(d->chunk + i + 1, d->chunk + i,
+		(d->nchunks - i) * sizeof(struct line_chunk *));
+	d->chunk[i] = c;
+	d->nchunks++;
+}
+
+static void dir_remove(struct line_dir *d, size_t i)
+{
+	chunk_unref(d->chunk[i]);
+	memmove(d->chunk + i, d->chunk + i + 1,
+		(d->nchunks - i - 1) * sizeof(struct line_chunk *));
+	d->nchunks--;
+}
+
+/*
+ * Move the cursor to the chunk holding line N and return N's
+ * offset within it; the end of the table is the end of the last chunk
+ */
+static size_t lines_seek(struct line_table *t, size_t n)
+{
+	struct line_dir *d = t->dir;
+
+	if (t->cur >= d->nchunks)
+		t->cur = t->cur_first = 0;
+	while (t->cur_first > n)
+		t->cur_first -= d->chunk[--t->cur]->count;
+	while (t->cur + 1 < d->nchunks &&
+	       n >= t->cur_first + d->chunk[t->cur]->count)
+		t->cur_first += d->chunk[t->cur++]->count;
+	return n - t->cur_first;
+}
+
+static int span_cmp(const void *a, const void *b)
+{
+	const struct delta_span *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static void spans_init(struct rcs2git *g, node_hash *nodes)
+{
+	Node *node;
+	int i;
+
+	g->span = xmalloc(nodes->entries * sizeof(struct delta_span));
+	for (i = 0; i < nodes->size; i++) {
+		node = nodes->table[i];
+		if (!node || !node->p)
+			continue;
+		g->span[g->nspans].start = (uchar *)node->p->text.text;
+		g->span[g->nspans].end = g->span[g->nspans].start +
+					 node->p->text.length;
+		g->span[g->nspans].refs = 0;
+		g->nspans++;
+	}
+	qsort(g->span, g->nspans, sizeof(struct delta_span), span_cmp);
+}
+
+static struct delta_span *span_find(struct rcs2git *g, uchar *p)
+{
+	struct delta_span *sp = g->span_hint;
+	size_t lo = 0, hi = g->nspans, mid;
+
+	if (sp && sp->start <= p && p < sp->end)
+		return sp;
+	while (lo + 1 < hi) {
+		mid = (lo + hi) / 2;
+		if (g->span[mid].start <= p)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return g->span_hint = &g->span[lo];
+}
+
+static void span_release(struct rcs2git *g, struct delta_span *sp)
+{
+	cvs_input_discard(g->input, (char *)sp->start, (char *)sp->end);
+}
+
+/* Trunk lines L[0..N-1] are going away */
+static void spans_unref(struct rcs2git *g, struct rcs_line *l, size_t n)
+{
+	struct delta_span *sp;
+
+	while (n--) {
+		sp = span_find(g, l++->text);
+		if (--sp->refs == 0 && sp != g->span_cur)
+			span_release(g, sp);
+	}
+}
+
+/* A branch and everything off it is done; drop its delta texts */
+static void release_branch(struct rcs2git *g, Node *node)
 {
-	if (n > Glinemax - Ggapsize)
+	for (; node; node = node->to)
+		cvs_input_discard(g->input, node->p->text.text,
+				  node->p->text.text + node->p->text.length);
+}
+
+/* Before line N, insert the NLINES lines at L.  N is 0-origin.  */
+static void insertlines(struct rcs2git *g, unsigned long n,
+			struct rcs_line *l, size_t nlines)
+{
+	struct line_table *t = &Glines;
+	struct line_dir *d;
+	struct line_chunk *c, *s;
+	size_t off, k;
+
+	if (n > t->nlines)
 		fatal_error("edit script tried to insert beyond eof");
-	if (!Ggapsize) {
-		if (Glinemax) {
-			Ggap = Ggapsize = Glinemax; Glinemax <<= 1;
-			Gline = xrealloc(Gline, sizeof(uchar *) * Glinemax);
-		} else {
-			Glinemax = Ggapsize = 1024;
-			Gline = xmalloc(sizeof(uchar *) *  Glinemax);
+	if (!nlines)
+		return;
+	d = lines_dir(t);
+	if (!d->nchunks)
+		dir_insert(d, 0, chunk_new());
+	while (nlines) {
+		off = lines_seek(t, n);
+		c = lines_chunk(d, t->cur);
+		if (c->count == LINE_CHUNK) {
+			s = chunk_new();
+			dir_insert(d, t->cur + 1, s);
+			if (off < LINE_CHUNK) {
+				/* split, keeping room on both sides */
+				s->count = LINE_CHUNK - LINE_CHUNK / 2;
+				c->count = LINE_CHUNK / 2;
+				memcpy(s->line, c->line + c->count,
+				       s->count * sizeof(struct rcs_line));
+			}
+			if (off >= c->count) {
+				off -= c->count;
+				t->cur_first += c->count;
+				t->cur++;
+				c = s;
+			}
 		}
+		k = min(nlines, LINE_CHUNK - c->count);
+		memmove(c->line + off + k, c->line + off,
+			(c->count - off) * sizeof(struct rcs_line));
+		memcpy(c->line + off, l, k * sizeof(struct rcs_line));
+		c->count += k;
+		t->nlines += k;
+		n += k;
+		l += k;
+		nlines -= k;
 	}
-	if (n < Ggap)
-		memmove(Gline+n+Ggapsize, Gline+n, (Ggap-n) * sizeof(uchar *));
-	else if (Ggap < n)
-		memmove(Gline+Ggap, Gline+Ggap+Ggapsize, (n-Ggap) * sizeof(uchar *));
-	Gline[n] = l;
-	Ggap = n + 1;
-	Ggapsize--;
 }
 
 /* Delete lines N through N+NLINES-1.  N is 0-origin.  */
-static void deletelines(unsigned long n, unsigned long nlines)
+static void deletelines(struct rcs2git *g, unsigned long n, unsigned long nlines)
 {
+	struct line_table *t = &Glines;
 	unsigned long l = n + nlines;
-	if (Glinemax-Ggapsize < l  ||  l < n)
+	struct line_dir *d;
+	struct line_chunk *c, *next;
+	size_t off, k;
+
+	if (t->nlines < l  ||  l < n)
 		fatal_error("edit script tried to delete beyond eof");
-	if (l < Ggap)
-		memmove(Gline+l+Ggapsize, Gline+l, (Ggap-l) * sizeof(uchar *));
-	else if (Ggap < n)
-		memmove(Gline+Ggap, Gline+Ggap+Ggapsize, (n-Ggap) * sizeof(uchar *));
-	Ggap = n;
-	Ggapsize += nlines;
+	if (!nlines)
+		return;
+	d = lines_dir(t);
+	while (nlines) {
+		off = lines_seek(t, n);
+		c = d->chunk[t->cur];
+		k = min(nlines, c->count - off);
+		if (g->span && !g->depth)
+			spans_unref(g, c->line + off, k);
+		if (k == c->count) {
+			dir_remove(d, t->cur);
+		} else {
+			c = lines_chunk(d, t->cur);
+			memmove(c->line + off, c->line + off + k,
+				(c->count - off - k) * sizeof(struct rcs_line));
+			c->count -= k;
+			/* fold small neighbours together */
+			if (t->cur + 1 < d->nchunks &&
+			    c->count + d->chunk[t->cur + 1]->count <= LINE_CHUNK / 2) {
+				next = d->chunk[t->cur + 1];
+				memcpy(c->line + c->count, next->line,
+				       next->count * sizeof(struct rcs_line));
+				c->count += next->count;
+				dir_remove(d, t->cur + 1);
+			}
+		}
+		nlines -= k;
+		t->nlines -= k;
+	}
 }
 
-static long parsenum(void)
+/* Return the start of the line after the one at P */
+static uchar *delta_line_end(uchar *p, uchar *close)
 {
-	int c;
+	uchar *nl = memchr(p, '\n', close - p);
+	return nl ? nl + 1 : close;
+}
+
+static long delta_number(uchar **pp, uchar *close)
+{
+	uchar *p = *pp;
 	long ret = 0;
-	for(c=in_buffer_getc(); isdigit(c); c=in_buffer_getc())
-		ret = (ret * 10) + (c - '0');
-	in_buffer_ungetc();
+	while (p < close && isdigit(*p))
+		ret = (ret * 10) + (*p++ - '0');
+	*pp = p;
 	return ret;
 }
 
-static int parse_next_delta_command(struct diffcmd *dc)
+static void script_add_line(struct delta_script *s, uchar *l, uchar *end)
 {
-	int cmd;
-	long line1, nlines;
-
-	cmd = in_buffer_getc();
-	if (cmd==EOF)
-		return -1;
-
-	line1 = parsenum();
+	if (s->nlines == s->maxlines) {
+		s->maxlines = s->maxlines ? s->maxlines * 2 : 256;
+		s->line = xrealloc(s->line, s->maxlines * sizeof(struct rcs_line));
+	}
+	s->line[s->nlines].text = l;
+	s->line[s->nlines].len = end - l;
+	s->nlines++;
+}
 
-	while (in_buffer_getc() == ' ')
-		;
-	in_buffer_ungetc();
+static struct delta_op *script_add_op(struct delta_script *s)
+{
+	if (s->nops == s->maxops) {
+		s->maxops = s->maxops ? s->maxops * 2 : 64;
+		s->op = xrealloc(s->op, s->maxops * sizeof(struct delta_op));
+	}
+	return &s->op[s->nops++];
+}
 
-	nlines = parsenum();
+/*
+ * Binary files have few newlines, so their lines are long and full
+ * of @s. Undouble each delta's @s once, into a copy kept until the
+ * file is done, so their revisions can be copied out as plain bytes.
+ * Returns the copy and sets *CLOSE to its end.
+ */
+static uchar *unescape_delta(struct rcs2git *g, uchar *p, uchar **close)
+{
+	uchar *text = xmalloc(*close - p), *t = text, *at;
+	struct alloclist *a = xmalloc(sizeof(struct alloclist));
 
-	while (in_buffer_getc() != '\n')
-		;
+	while ((at = memchr(p, SDELIM, *close - p))) {
+		memcpy(t, p, at + 1 - p);
+		t += at + 1 - p;
+		p = at + 2;
+	}
+	memcpy(t, p, *close - p);
+	t += *close - p;
+	a->alloc = text;
+	a->nextalloc = g->unescaped;
+	g->unescaped = a;
+	*close = t;
+	return text;
+}
 
-	if (!nlines || (cmd != 'a' && cmd != 'd') || line1+nlines < line1)
-		fatal_error("Corrupt delta");
+/*
+ * Decode a delta text into g->script. The closing @ is known from the
+ * text's length, and any @ before it is half of an @@ pair, so lines
+ * end at the next newline and need no per-character escape checks.
+ * The head revision's text is all lines; other deltas are commands.
+ */
+static void compile_delta(struct rcs2git *g, cvs_text *text,
+			  enum stringwork func)
+{
+	struct delta_script *s = &g->script;
+	uchar *p = (uchar *)text->text;
+	uchar *close = p + text->length - 1;
+	struct delta_op *op;
+	long adprev = 0, dafter = 0, line1, nlines;
+	uchar *nl;
+	int cmd;
 
-	if (cmd == 'a') {
-		if (line1 < dc->adprev)
-			fatal_error("backward insertion in delta");
-		dc->adprev = line1 + 1;
-	} else if (cmd == 'd') {
-		if (line1 < dc->adprev  ||  line1 < dc->dafter)
-			fatal_error("backward deletion in delta");
-		dc->adprev = line1;
-		dc->dafter = line1 + nlines;
+	s->nops = s->nlines = 0;
+	if (text->length < 2 || *p++ != SDELIM)
+		fatal_error("Illegal buffer, missing @ in %s", g->filename);
+	if (g->expand == EXPANDKB && !g->input->stream &&
+	    memchr(p, SDELIM, close - p))
+		p = unescape_delta(g, p, &close);
+	if (func == ENTER) {
+		while (p < close) {
+			nl = delta_line_end(p, close);
+			script_add_line(s, p, nl);
+			p = nl;
+		}
+		return;
 	}
+	while (p < close) {
+		cmd = *p++;
+		line1 = delta_number(&p, close);
+		while (p < close && *p == ' ')
+			p++;
+		nlines = delta_number(&p, close);
+		nl = memchr(p, '\n', close - p);
+		if (!nl || !nlines || (cmd != 'a' && cmd != 'd') ||
+		    line1+nlines < line1)
+			fatal_error("Corrupt delta");
+		p = nl + 1;
+
+		if (cmd == 'a') {
+			if (line1 < adprev)
+				fatal_error("backward insertion in delta");
+			adprev = line1 + 1;
+		} else {
+			if (line1 < adprev  ||  line1 < dafter)
+				fatal_error("backward deletion in delta");
+			adprev = line1;
+			dafter = line1 + nlines;
+		}
 
-	dc->line1 = line1;
-	dc->nlines = nlines;
-	return cmd == 'a';
+		op = script_add_op(s);
+		op->cmd = cmd;
+		op->line1 = line1;
+		op->nlines = nlines;
+		op->first = s->nlines;
+		if (cmd == 'a') {
+			while (nlines--) {
+				if (p >= close)
+					fatal_error("Corrupt delta");
+				nl = delta_line_end(p, close);
+				script_add_line(s, p, nl);
+				p = nl;
+			}
+		}
+	}
 }
 
-static void escape_string(register char const *s)
+static void escape_string(struct rcs2git *g, register char const *s)
 {
 	register char c;
 	for (;;) {
 		switch ((c = *s++)) {
 		case 0:		return;
-		case '\t':	out_fputs("\\t"); break;
-		case '\n':	out_fputs("\\n"); break;
-		case ' ':	out_fputs("\\040"); break;
-		case KDELIM:	out_fputs("\\044"); break;
-		case '\\':	out_fputs("\\\\"); break;
-		default:	out_putc(c); break;
+		case '\t':	out_fputs(g, "\\t"); break;
+		case '\n':	out_fputs(g, "\\n"); break;
+		case ' ':	out_fputs(g, "\\040"); break;
+		case KDELIM:	out_fputs(g, "\\044"); break;
+		case '\\':	out_fputs(g, "\\\\"); break;
+		default:	out_putc(g, c); break;
 		}
 	}
 }
 
 /* output the appropriate keyword value(s) */
-static void keyreplace(enum markers marker)
+static void keyreplace(struct rcs2git *g, enum markers marker)
 {
 	const char *target_lockedby = NULL;	// Not wired in yet
 
@@ -487,67 +929,68 @@ static void keyreplace(enum markers marker)
 	size_t cs, cw, ls;
 	char *leader = NULL;
 	char date_string[25];
+	struct tm tm;
 	uchar *kdelim_ptr = NULL;
-	enum expand_mode exp = Gexpand;
+	enum expand_mode exp = g->expand;
 	char const *sp = Keyword[(int)marker];
 
 	strftime(date_string, 25,
-		"%Y/%m/%d %H:%M:%S", localtime(&Gversion->date));
+		"%Y/%m/%d %H:%M:%S", localtime_r(&g->version->date, &tm));
 
 	if (exp != EXPANDKV)
-		out_printf("%c%s", KDELIM, sp);
+		out_printf(g, "%c%s", KDELIM, sp);
 
 	if (exp != EXPANDKK) {
 		if (exp != EXPANDKV)
-			out_printf("%c%c", VDELIM, ' ');
+			out_printf(g, "%c%c", VDELIM, ' ');
 
 		switch (marker) {
 		case Author:
-			out_fputs(Gversion->author);
+			out_fputs(g, g->version->author);
 			break;
 		case Date:
-			out_fputs(date_string);
+			out_fputs(g, date_string);
 			break;
 		case Id:
 		case Header:
 			if (marker == Id )
-				escape_string(basefilename(Gfilename));
-			else	escape_string(getfullRCSname());
-			out_printf(" %s %s %s %s",
-				Gversion_number, date_string,
-				Gversion->author, Gversion->state);
+				escape_string(g, basefilename(g->filename));
+			else	escape_string(g, getfullRCSname(g));
+			out_printf(g, " %s %s %s %s",
+				g->version_number, date_string,
+				g->version->author, g->version->state);
 			if (target_lockedby && exp == EXPANDKKVL)
-				out_printf(" %s", target_lockedby);
+				out_printf(g, " %s", target_lockedby);
 			break;
 		case Locker:
 			if (target_lockedby && exp == EXPANDKKVL)
-				out_fputs(target_lockedby);
+				out_fputs(g, target_lockedby);
 			break;
 		case Log:
 		case RCSfile:
-			escape_string(basefilename(Gfilename));
+			escape_string(g, basefilename(g->filename));
 			break;
 		case Revision:
-			out_fputs(Gversion_number);
+			out_fputs(g, g->version_number);
 			break;
 		case Source:
-			escape_string(getfullRCSname());
+			escape_string(g, getfullRCSname(g));
 			break;
 		case State:
-			out_fputs(Gversion->state);
+			out_fputs(g, g->version->state);
 			break;
 		default:
 			break;
 		}
 
 		if (exp != EXPANDKV)
-			out_putc(' ');
+			out_putc(g, ' ');
 	}
 
 #if 0
 /* Closing delimiter is processed again in expandline */
 	if (exp != EXPANDKV)
-	    out_putc(KDELIM);
+	    out_putc(g, KDELIM);
 #endif
 
 	if (marker == Log) {
@@ -556,21 +999,21 @@ static void keyreplace(enum markers marker)
 		 * does not apply here, since we consume the input.
 		 */
 		if (exp != EXPANDKV)
-			out_putc(KDELIM);
+			out_putc(g, KDELIM);
 
-		sp = Glog;
-		ls = strlen(Glog);
+		sp = g->log;
+		ls = strlen(g->log);
 		if (sizeof(ciklog)-1<=ls && !memcmp(sp,ciklog,sizeof(ciklog)-1))
 			return;
 
 		/* Back up to the start of the current input line */
                 int num_kdelims = 0;
 		for (;;) {
-			c = in_buffer_ungetc();
+			c = in_buffer_ungetc(g);
 			if (c == EOF)
 				break;
 			if (c == '\n') {
-				in_buffer_getc();
+				in_buffer_getc(g);
 				break;
 			}
 			if (c == KDELIM) {
@@ -579,17 +1022,17 @@ static void keyreplace(enum markers marker)
                                    on one line. Make sure we don't backtrack
                                    into some other keyword! */
                                 if (num_kdelims > 2) {
-                                        in_buffer_getc();
+                                        in_buffer_getc(g);
                                         break;
                                 }
-				kdelim_ptr = in_buffer_loc();
+				kdelim_ptr = in_buffer_loc(g);
                         }
 		}
 
 		/* Copy characters before `$Log' into LEADER.  */
-		xxp = leader = xmalloc(kdelim_ptr - in_buffer_loc());
+		xxp = leader = xmalloc(kdelim_ptr - in_buffer_loc(g));
 		for (cs = 0; ;  cs++) {
-			c = in_buffer_getc();
+			c = in_buffer_getc(g);
 			if (c == KDELIM)
 				break;
 			leader[cs] = c;
@@ -613,31 +1056,31 @@ static void keyreplace(enum markers marker)
 
 		/* Skip `$Log ... $' string.  */
 		do {
-			c = in_buffer_getc();
+			c = in_buffer_getc(g);
 		} while (c != KDELIM);
 
-		out_putc('\n');
-		out_awrite(xxp, cs);
-		out_printf("Revision %s  %s  %s",
-				Gversion_number,
+		out_putc(g, '\n');
+		out_awrite(g, xxp, cs);
+		out_printf(g, "Revision %s  %s  %s",
+				g->version_number,
 				date_string,
-				Gversion->author);
+				g->version->author);
 
 		/* Do not include state: it may change and is not updated.  */
 		cw = cs;
 		for (;  cw && (xxp[cw-1]==' ' || xxp[cw-1]=='\t');  --cw)
 			;
 		for (;;) {
-			out_putc('\n');
-			out_awrite(xxp, cw);
+			out_putc(g, '\n');
+			out_awrite(g, xxp, cw);
 			if (!ls)
 				break;
 			--ls;
 			c = *sp++;
 			if (c != '\n') {
-				out_awrite(xxp+cw, cs-cw);
+				out_awrite(g, xxp+cw, cs-cw);
 				do {
-					out_putc(c);
+					out_putc(g, c);
 					if (!ls)
 						break;
 					--ls;
@@ -649,7 +1092,7 @@ static void keyreplace(enum markers marker)
 	}
 }
 
-static int expandline(void)
+static int expandline(struct rcs2git *g)
 {
 	register int c = 0;
 	char * tp;
@@ -658,62 +1101,62 @@ static int expandline(void)
         enum markers matchresult;
 	int orig_size;
 
-	if (Gkvlen < KEYLENGTH+3) {
-		Gkvlen = KEYLENGTH + 3;
-		Gkeyval = xrealloc(Gkeyval, Gkvlen);
+	if (g->kvlen < KEYLENGTH+3) {
+		g->kvlen = KEYLENGTH + 3;
+		g->keyval = xrealloc(g->keyval, g->kvlen);
 	}
 	e = 0;
 	r = -1;
 
         for (;;) {
-	    c = in_buffer_getc();
+	    c = in_buffer_getc(g);
 	    for (;;) {
 		switch (c) {
 		    case EOF:
 			goto uncache_exit;
 		    default:
-			out_putc(c);
+			out_putc(g, c);
 			r = 0;
 			break;
 		    case '\n':
-			out_putc(c);
+			out_putc(g, c);
 			r = 2;
 			goto uncache_exit;
 		    case KDELIM:
 			r = 0;
                         /* check for keyword */
                         /* first, copy a long enough string into keystring */
-			tp = Gkeyval;
+			tp = g->keyval;
 			*tp++ = KDELIM;
 			for (;;) {
-			    c = in_buffer_getc();
-			    if (tp <= &Gkeyval[KEYLENGTH] && latin1_alpha(c))
+			    c = in_buffer_getc(g);
+			    if (tp <= &g->keyval[KEYLENGTH] && latin1_alpha(c))
 					*tp++ = c;
 			    else	break;
                         }
 			*tp++ = c; *tp = '\0';
-			matchresult = trymatch(Gkeyval+1);
+			matchresult = trymatch(g->keyval+1);
 			if (matchresult==Nomatch) {
 				tp[-1] = 0;
-				out_fputs(Gkeyval);
+				out_fputs(g, g->keyval);
 				continue;   /* last c handled properly */
 			}
 
 			/* Now we have a keyword terminated with a K/VDELIM */
 			if (c==VDELIM) {
 			      /* try to find closing KDELIM, and replace value */
-			      tlim = Gkeyval + Gkvlen;
+			      tlim = g->keyval + g->kvlen;
 			      for (;;) {
-				     c = in_buffer_getc();
+				     c = in_buffer_getc(g);
 				      if (c=='\n' || c==KDELIM)
 					break;
 				      *tp++ =c;
 				      if (tlim <= tp) {
-					    orig_size = Gkvlen;
-					    Gkvlen *= 2;
-					    Gkeyval = xrealloc(Gkeyval, Gkvlen);
-					    tlim = Gkeyval + Gkvlen;
-					    tp = Gkeyval + orig_size;
+					    orig_size = g->kvlen;
+					    g->kvlen *= 2;
+					    g->keyval = xrealloc(g->keyval, g->kvlen);
+					    tlim = g->keyval + g->kvlen;
+					    tp = g->keyval + orig_size;
 
 					}
 				      if (c==EOF)
@@ -722,7 +1165,7 @@ static int expandline(void)
 			      if (c!=KDELIM) {
 				    /* couldn't find closing KDELIM -- give up */
 				    *tp = 0;
-				    out_fputs(Gkeyval);
+				    out_fputs(g, g->keyval);
 				    continue;   /* last c handled properly */
 			      }
 			}
@@ -735,10 +1178,10 @@ static int expandline(void)
 			 * it.
 			 */
 			if (c == KDELIM)
-				in_buffer_ungetc();
+				in_buffer_ungetc(g);
 
 			/* now put out the new keyword value */
-			keyreplace(matchresult);
+			keyreplace(g, matchresult);
 			e = 1;
 			break;
                 }
@@ -748,144 +1191,711 @@ static int expandline(void)
 
     keystring_eof:
 	*tp = 0;
-	out_fputs(Gkeyval);
+	out_fputs(g, g->keyval);
     uncache_exit:
 	return r + e;
 }
 
-static void process_delta(Node *node, enum stringwork func)
+static void process_delta(struct rcs2git *g, Node *node, enum stringwork func)
 {
-	long editline = 0, linecnt = 0, adjust = 0;
-	int editor_command;
-	struct diffcmd dc;
-	uchar *ptr;
-
-	Glog = node->p->log;
-	in_buffer_init((uchar *)node->p->text, 1);
-	Gversion = node->v;
-	cvs_number_string(&Gversion->number, Gversion_number);
-
+	struct delta_script *s = &g->script;
+	struct delta_op *op;
+	long adjust = 0;
+
+	g->log = node->p->log;
+	g->version = node->v;
+	cvs_number_string(&g->version->number, g->version_number);
+
+	compile_delta(g, &node->p->text, func);
+	if (g->span && !g->depth) {
+		g->span_cur = span_find(g, (uchar *)node->p->text.text);
+		g->span_cur->refs += s->nlines;
+	}
 	switch (func) {
 	case ENTER:
-		while( (ptr=in_get_line()) )
-			insertline(editline++, ptr);
+		insertlines(g, 0, s->line, s->nlines);
+		break;
 	case EDIT:
-		dc.dafter = dc.adprev = 0;
-		while ((editor_command = parse_next_delta_command(&dc)) >= 0) {
-			if (editor_command) {
-				editline = dc.line1 + adjust;
-				linecnt = dc.nlines;
-				while(linecnt--)
-					insertline(editline++, in_get_line());
-				adjust += dc.nlines;
+		for (op = s->op; op < s->op + s->nops; op++) {
+			if (op->cmd == 'a') {
+				insertlines(g, op->line1 + adjust,
+					    s->line + op->first, op->nlines);
+				adjust += op->nlines;
 			} else {
-				deletelines(dc.line1 - 1 + adjust, dc.nlines);
-				adjust -= dc.nlines;
+				deletelines(g, op->line1 - 1 + adjust, op->nlines);
+				adjust -= op->nlines;
 			}
 		}
 		break;
 	}
+	if (g->span_cur) {
+		if (g->span_cur->refs == 0)
+			span_release(g, g->span_cur);
+		g->span_cur = NULL;
+	}
 }
 
-static void finishedit(void)
+static void mark_line(struct rcs2git *g, uchar *text, unsigned long off)
 {
-	uchar **p, **lim, **l = Gline;
-	for (p=l, lim=l+Ggap;  p<lim;  ) {
-		in_buffer_init(*p++, 0);
-		expandline();
+	if (g->nmarks == g->maxmarks) {
+		g->maxmarks = g->maxmarks ? g->maxmarks * 2 : 1024;
+		g->mark = xrealloc(g->mark,
+				   g->maxmarks * sizeof(struct line_mark));
 	}
-	for (p+=Ggapsize, lim=l+Glinemax;  p<lim;  ) {
-		in_buffer_init(*p++, 0);
-		expandline();
+	g->mark[g->nmarks].text = text;
+	g->mark[g->nmarks].off = off;
+	g->nmarks++;
+}
+
+static unsigned long base_hash(struct delta_base *b, uchar *text)
+{
+	return (unsigned long)
+		(((uint64_t)(uintptr_t)text * 0x9e3779b97f4a7c15ULL) >> 32) &
+		b->mask;
+}
+
+static struct base_line *base_find(struct delta_base *b, uchar *text)
+{
+	unsigned long i;
+
+	for (i = base_hash(b, text); b->line[i].text; i = (i + 1) & b->mask)
+		if (b->line[i].text == text)
+			return &b->line[i];
+	return NULL;
+}
+
+/* Make the blob just marked, LEN bytes long, the base for the next */
+static struct delta_base *base_new(struct rcs2git *g, rev_file *file,
+				   unsigned long len)
+{
+	struct delta_base *b = xmalloc(sizeof(struct delta_base));
+	struct line_mark *m;
+	unsigned long i, n = 16;
+
+	while (n < g->nmarks + g->nmarks / 2)
+		n *= 2;
+	b->refs = 1;
+	b->file = file;
+	b->size = len;
+	b->mask = n - 1;
+	b->line = calloc(n, sizeof(struct base_line));
+	if (!b->line)
+		fatal_system_error("calloc");
+	for (m = g->mark; m < g->mark + g->nmarks; m++) {
+		if (!m->text)
+			continue;
+		for (i = base_hash(b, m->text); b->line[i].text;
+		     i = (i + 1) & b->mask)
+			;
+		b->line[i].text = m->text;
+		b->line[i].off = m->off;
+		b->line[i].len = (m + 1 < g->mark + g->nmarks ?
+				  m[1].off : len) - m->off;
 	}
+	return b;
 }
 
-static void snapshotline(register uchar * l)
+static void base_unref(struct delta_base *b)
 {
-	register int c;
+	if (b && refs_dec(&b->refs) == 0) {
+		free(b->line);
+		free(b);
+	}
+}
+
+static void delta_put(struct rcs2git *g, const void *p, size_t n)
+{
+	if (g->ndelta + n > g->maxdelta) {
+		g->maxdelta = max(g->maxdelta * 2, g->ndelta + n + 256);
+		g->delta = xrealloc(g->delta, g->maxdelta);
+	}
+	memcpy(g->delta + g->ndelta, p, n);
+	g->ndelta += n;
+}
+
+static void delta_size(struct rcs2git *g, unsigned long size)
+{
+	uchar c;
+
 	do {
-		if ((c = *l++) == SDELIM  &&  *l++ != SDELIM)
-			return;
-		out_putc(c);
-	} while (c != '\n');
+		c = size & 0x7f;
+		size >>= 7;
+		if (size)
+			c |= 0x80;
+		delta_put(g, &c, 1);
+	} while (size);
+}
+
+static void delta_insert(struct rcs2git *g, uchar *p, unsigned long len)
+{
+	uchar n;
+
+	while (len) {
+		n = min(len, 0x7f);
+		delta_put(g, &n, 1);
+		delta_put(g, p, n);
+		p += n;
+		len -= n;
+	}
+}
+
+static void delta_copy(struct rcs2git *g, unsigned long off, unsigned long len)
+{
+	uchar cmd[8];
+	unsigned long n;
+	int i, c;
+
+	while (len) {
+		n = min(len, 0x10000);
+		c = 1;
+		cmd[0] = 0x80;
+		for (i = 0; i < 4; i++)
+			if ((off >> (8 * i)) & 0xff) {
+				cmd[0] |= 1 << i;
+				cmd[c++] = off >> (8 * i);
+			}
+		for (i = 0; i < 3; i++)
+			if ((n >> (8 * i)) & 0xff) {
+				cmd[0] |= 0x10 << i;
+				cmd[c++] = n >> (8 * i);
+			}
+		delta_put(g, cmd, c);
+		off += n;
+		len -= n;
+	}
+}
+
+/*
+ * Encode the blob TEXT just marked as a git delta against the walk's
+ * base, merging runs of lines that sit together in both
+ */
+static void build_delta(struct rcs2git *g, uchar *text, unsigned long len)
+{
+	struct delta_base *b = Gbase;
+	struct base_line *bl;
+	unsigned long i, off, end;
+	unsigned long copy = 0, ncopy = 0, lit = 0, nlit = 0;
+
+	g->ndelta = 0;
+	delta_size(g, b->size);
+	delta_size(g, len);
+	for (i = 0; i < g->nmarks; i++) {
+		off = g->mark[i].off;
+		end = i + 1 < g->nmarks ? g->mark[i + 1].off : len;
+		if (end == off)
+			continue;
+		bl = g->mark[i].text ? base_find(b, g->mark[i].text) : NULL;
+		if (bl && bl->len == end - off) {
+			if (nlit) {
+				delta_insert(g, text + lit, nlit);
+				nlit = 0;
+			}
+			if (ncopy && copy + ncopy == bl->off) {
+				ncopy += bl->len;
+				continue;
+			}
+			if (ncopy)
+				delta_copy(g, copy, ncopy);
+			copy = bl->off;
+			ncopy = bl->len;
+		} else {
+			if (ncopy) {
+				delta_copy(g, copy, ncopy);
+				ncopy = 0;
+			}
+			if (!nlit)
+				lit = off;
+			nlit += end - off;
+		}
+	}
+	if (ncopy)
+		delta_copy(g, copy, ncopy);
+	if (nlit)
+		delta_insert(g, text + lit, nlit);
+}
+
+/*
+ * Copy line L out, undoubling any @s; all of them are in pairs since
+ * the line's length stops short of the closing @
+ */
+static void snapshotline(struct rcs2git *g, struct rcs_line *l)
+{
+	uchar *p = l->text, *end = p + l->len, *at;
 
+	while ((at = memchr(p, SDELIM, end - p))) {
+		out_awrite(g, (char *)p, at + 1 - p);
+		p = at + 2;
+	}
+	out_awrite(g, (char *)p, end - p);
 }
 
-static void snapshotedit(void)
+/* Most lines hold no keywords and are copied out whole */
+static void finishedit(struct rcs2git *g)
 {
-	uchar **p, **lim, **l=Gline;
-	for (p=l, lim=l+Ggap;  p<lim;  )
-		snapshotline(*p++);
-	for (p+=Ggapsize, lim=l+Glinemax;  p<lim;  )
-		snapshotline(*p++);
+	struct line_dir *d = Glines.dir;
+	struct rcs_line *l;
+	size_t i;
+	int j;
+
+	for (i = 0; d && i < d->nchunks; i++)
+		for (j = 0; j < d->chunk[i]->count; j++) {
+			l = &d->chunk[i]->line[j];
+			if (memchr(l->text, KDELIM, l->len)) {
+				if (g->deltas)
+					mark_line(g, NULL, out_buffer_count(g));
+				in_buffer_init(g, l->text);
+				expandline(g);
+			} else {
+				if (g->deltas)
+					mark_line(g, l->text,
+						  out_buffer_count(g));
+				snapshotline(g, l);
+			}
+		}
+}
+
+static void snapshotedit(struct rcs2git *g)
+{
+	struct line_dir *d = Glines.dir;
+	struct rcs_line *l;
+	size_t i;
+	int j;
+
+	for (i = 0; d && i < d->nchunks; i++)
+		for (j = 0; j < d->chunk[i]->count; j++) {
+			l = &d->chunk[i]->line[j];
+			if (g->deltas)
+				mark_line(g, l->text, out_buffer_count(g));
+			snapshotline(g, l);
+		}
+}
+
+/*
+ * Binary lines are already unescaped; lines that sit next to each
+ * other in one delta text go out in a single copy
+ */
+static void binaryedit(struct rcs2git *g)
+{
+	struct line_dir *d = Glines.dir;
+	struct rcs_line *l;
+	uchar *run = NULL;
+	size_t len = 0;
+	size_t i;
+	int j;
+
+	for (i = 0; d && i < d->nchunks; i++)
+		for (j = 0; j < d->chunk[i]->count; j++) {
+			l = &d->chunk[i]->line[j];
+			if (run + len != l->text) {
+				if (len)
+					out_awrite(g, (char *)run, len);
+				run = l->text;
+				len = 0;
+			}
+			if (g->deltas)
+				mark_line(g, l->text,
+					  out_buffer_count(g) + len);
+			len += l->len;
+		}
+	if (len)
+		out_awrite(g, (char *)run, len);
 }
 
-extern int write_sha1_file(	void *buf, unsigned long len,
-				const char *type, uchar *return_sha1);
 extern char *sha1_to_hex(const uchar *sha1);
+extern int get_sha1_hex(const char *hex, uchar *sha1);
+
+/*
+ * Rendered revisions are handed to a writer thread which hashes,
+ * compresses and packs them while the delta walk carries on. Blobs
+ * must reach the pack after any BASE they are a DELTA from, so one
+ * writer serves every file being loaded. Queued and in-flight text
+ * is limited to BLOB_QUEUE_BYTES so that walks through large files
+ * cannot run far ahead of it.
+ */
+#define BLOB_QUEUE_BYTES (32 << 20)
+
+struct blob_job {
+	struct blob_job *next;
+	char *text;
+	unsigned long len;
+	rev_file *file;
+	rev_file *base;
+	uchar *delta;
+	unsigned long delta_len;
+	int *pending;
+};
 
-static void enter_branch(Node *node)
+static pthread_mutex_t blob_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blob_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t blob_done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t blob_once = PTHREAD_ONCE_INIT;
+static struct blob_job *blob_head, **blob_tail = &blob_head;
+static size_t blob_bytes;
+
+static void *blob_writer(void *closure)
 {
-	uchar **p = xmalloc(sizeof(uchar *) * stack[depth].linemax);
-	memcpy(p, stack[depth].line, sizeof(uchar *) * stack[depth].linemax);
-	stack[depth + 1] = stack[depth];
-	stack[depth + 1].next_branch = node->sib;
-	stack[depth + 1].line = p;
-	depth++;
+	struct blob_job *j;
+	char sha1_ascii[41];
+	uchar sha1[20], base[20];
+
+	for (;;) {
+		pthread_mutex_lock(&blob_mutex);
+		while (!blob_head)
+			pthread_cond_wait(&blob_work, &blob_mutex);
+		j = blob_head;
+		blob_head = j->next;
+		if (!blob_head)
+			blob_tail = &blob_head;
+		pthread_mutex_unlock(&blob_mutex);
+
+		if (j->base)
+			get_sha1_hex(j->base->sha1, base);
+		pack_blob(j->text, j->len, j->base ? base : NULL,
+			  j->delta, j->delta_len, sha1);
+		git_lock_objects();
+		strncpy(sha1_ascii, sha1_to_hex(sha1), 41);
+		git_unlock_objects();
+		free(j->text);
+		free(j->delta);
+		j->file->sha1 = atom(sha1_ascii);
+
+		pthread_mutex_lock(&blob_mutex);
+		blob_bytes -= j->len + j->delta_len;
+		--*j->pending;
+		pthread_cond_broadcast(&blob_done);
+		pthread_mutex_unlock(&blob_mutex);
+		free(j);
+	}
+	return NULL;
 }
 
-void generate_files(cvs_file *cvs)
+static void blob_start(void)
 {
-	int expand_override_enabled = 1;
-	int expandflag = Gexpand < EXPANDKO;
-	Node *node = head_node;
-	depth = 0;
-	Gfilename = cvs->name;
-	if (cvs->expand && expand_override_enabled)
-		Gexpand = expand_override(cvs->expand);
-	else	Gexpand = EXPANDKK;
-	Gabspath = NULL;
-	Gline = NULL; Ggap = Ggapsize = Glinemax = 0;
-	stack[0].node = node;
-	process_delta(node, ENTER);
+	pthread_t writer;
+
+	if (pthread_create(&writer, NULL, blob_writer, NULL) != 0)
+		fatal_system_error("pthread_create");
+	pthread_detach(writer);
+}
+
+/* Wait until every blob counted in PENDING has been stored */
+static void blob_wait(int *pending)
+{
+	pthread_mutex_lock(&blob_mutex);
+	while (*pending)
+		pthread_cond_wait(&blob_done, &blob_mutex);
+	pthread_mutex_unlock(&blob_mutex);
+}
+
+/*
+ * Queue TEXT to be stored as FILE's blob, and DELTA, if any, to make
+ * it from BASE's; the writer frees both
+ */
+static void blob_submit(char *text, unsigned long len, rev_file *file,
+			rev_file *base, uchar *delta, unsigned long delta_len,
+			int *pending)
+{
+	struct blob_job *j = xmalloc(sizeof(struct blob_job));
+
+	pthread_once(&blob_once, blob_start);
+	j->next = NULL;
+	j->text = text;
+	j->len = len;
+	j->file = file;
+	j->base = base;
+	j->delta = delta;
+	j->delta_len = delta_len;
+	j->pending = pending;
+	len += delta_len;
+	pthread_mutex_lock(&blob_mutex);
+	while (blob_bytes && blob_bytes + len > BLOB_QUEUE_BYTES)
+		pthread_cond_wait(&blob_done, &blob_mutex);
+	blob_bytes += len;
+	++*pending;
+	*blob_tail = j;
+	blob_tail = &j->next;
+	pthread_cond_signal(&blob_work);
+	pthread_mutex_unlock(&blob_mutex);
+	/* let an oversized blob go before rendering another */
+	if (len > BLOB_QUEUE_BYTES)
+		blob_wait(pending);
+}
+
+static void enter_branch(struct rcs2git *g, Node *node)
+{
+	g->stack[g->depth + 1] = g->stack[g->depth];
+	g->stack[g->depth + 1].next_branch = node->sib;
+	g->stack[g->depth + 1].branch = node;
+	lines_share(&g->stack[g->depth + 1].lines, &g->stack[g->depth].lines);
+	if (Gbase)
+		refs_inc(&Gbase->refs);
+	g->depth++;
+}
+
+/*
+ * Each branch depends only on the lines at its branch point, so with
+ * checkout_jobs above one, the trunk walk gives every branch off the
+ * trunk a reference to its lines and queues it for a pool of workers.
+ * Branches off branches are walked by whoever has their parent.
+ */
+int checkout_jobs = 1;
+
+struct walk_task {
+	struct walk_task *next;
+	struct walk_file *file;
+	Node *branch;
+	struct line_table lines;
+	struct delta_base *base;
+};
+
+static pthread_mutex_t walk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t walk_done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t walk_once = PTHREAD_ONCE_INIT;
+static struct walk_task *walk_head, **walk_tail = &walk_head;
+
+static void walk_init(struct rcs2git *g, struct walk_file *f)
+{
+	memset(g, 0, sizeof(*g));
+	g->file = f;
+	g->filename = f->ctx->file->name;
+	g->expand = f->expand;
+	g->input = &f->ctx->input;
+	g->deltas = pack_deltas && f->store;
+}
+
+static void walk_fini(struct rcs2git *g)
+{
+	struct alloclist *a;
+
+	while ((a = g->unescaped)) {
+		g->unescaped = a->nextalloc;
+		free(a->alloc);
+		free(a);
+	}
+	free(g->span);
+	free(g->mark);
+	free(g->delta);
+	free(g->outbuf.text);
+	free(g->script.op);
+	free(g->script.line);
+	free(g->keyval);
+	free(g->abspath);
+}
+
+/*
+ * Hand the blob just rendered to the writer, with a delta against
+ * the walk's base when there is one, then make it the new base
+ */
+static void store_blob(struct rcs2git *g, rev_file *file, unsigned long len)
+{
+	struct delta_base *b = Gbase;
+	rev_file *base = NULL;
+	uchar *delta = NULL;
+	unsigned long delta_len = 0;
+
+	if (g->deltas) {
+		if (b) {
+			build_delta(g, (uchar *)g->outbuf.text, len);
+			if (g->ndelta < len) {
+				base = b->file;
+				delta = g->delta;
+				delta_len = g->ndelta;
+				g->delta = NULL;
+				g->maxdelta = 0;
+			}
+		}
+		/* copy commands hold 32 bit offsets */
+		Gbase = len <= 0xffffffffUL ? base_new(g, file, len) : NULL;
+		base_unref(b);
+	}
+	blob_submit(out_buffer_detach(g), len, file, base, delta, delta_len,
+		    &g->file->pending);
+}
+
+static Node *spawn_branches(struct rcs2git *g, Node *node);
+
+/* Write out NODE and every revision after it, depth first */
+static void walk(struct rcs2git *g, Node *node)
+{
+	int expandflag = g->expand < EXPANDKO;
+	unsigned long len;
+
 	while (1) {
 		if (node->file) {
-			char sha1_ascii[41];
-			uchar sha1[20];
-			out_buffer_init();
+			out_buffer_init(g);
+			g->nmarks = 0;
 			if (expandflag)
-				finishedit();
+				finishedit(g);
+			else if (g->expand == EXPANDKB && !g->input->stream)
+				binaryedit(g);
 			else
-				snapshotedit();
-			write_sha1_file(out_buffer_text(),
-					out_buffer_count(),
-					"blob", sha1);
-			out_buffer_cleanup();
-			strncpy(sha1_ascii, sha1_to_hex(sha1), 41);
-			node->file->sha1 = atom(sha1_ascii);
+				snapshotedit(g);
+			len = out_buffer_count(g);
+			__atomic_add_fetch(&g->file->bytes, len,
+					   __ATOMIC_RELAXED);
+			if (g->file->store)
+				store_blob(g, node->file, len);
 		}
-		node = node->down;
+		if (g->spawn && !g->depth)
+			node = spawn_branches(g, node);
+		else
+			node = node->down;
 		if (node) {
-			enter_branch(node);
+			enter_branch(g, node);
 			goto Next;
 		}
-		while ((node = stack[depth].node->to) == NULL) {
-			free(stack[depth].line);
-			if (!depth)
-				goto Done;
-			node = stack[depth--].next_branch;
+		while ((node = g->stack[g->depth].node->to) == NULL) {
+			lines_free(&g->stack[g->depth].lines);
+			base_unref(Gbase);
+			if (!g->depth)
+				return;
+			if (g->input->stream)
+				release_branch(g, g->stack[g->depth].branch);
+			node = g->stack[g->depth--].next_branch;
 			if (node) {
-				enter_branch(node);
+				enter_branch(g, node);
 				break;
 			}
 		}
 Next:
-		stack[depth].node = node;
-		process_delta(node, EDIT);
-	}
-Done:
-	free(Gkeyval);
-	Gkeyval = NULL;
-	Gkvlen = 0;
-	free(Gabspath);
+		g->stack[g->depth].node = node;
+		process_delta(g, node, EDIT);
+	}
+}
+
+static void walk_branch(struct walk_task *t)
+{
+	struct rcs2git state, *g = &state;
+
+	walk_init(g, t->file);
+	g->stack[0].node = t->branch;
+	g->stack[0].branch = t->branch;
+	g->stack[0].lines = t->lines;
+	g->stack[0].base = t->base;
+	process_delta(g, t->branch, EDIT);
+	walk(g, t->branch);
+	if (g->input->stream)
+		release_branch(g, t->branch);
+	walk_fini(g);
+
+	pthread_mutex_lock(&walk_mutex);
+	t->file->tasks--;
+	pthread_cond_broadcast(&walk_done);
+	pthread_mutex_unlock(&walk_mutex);
+	free(t);
+}
+
+/* Take the next queued branch; called with walk_mutex held */
+static struct walk_task *walk_next(void)
+{
+	struct walk_task *t = walk_head;
+
+	if (t) {
+		walk_head = t->next;
+		if (!walk_head)
+			walk_tail = &walk_head;
+	}
+	return t;
+}
+
+static void *walk_worker(void *closure)
+{
+	struct walk_task *t;
+
+	for (;;) {
+		pthread_mutex_lock(&walk_mutex);
+		while (!(t = walk_next()))
+			pthread_cond_wait(&walk_work, &walk_mutex);
+		pthread_mutex_unlock(&walk_mutex);
+		walk_branch(t);
+	}
+	return NULL;
+}
+
+static void walk_start(void)
+{
+	pthread_t worker;
+	int i;
+
+	for (i = 0; i < checkout_jobs; i++) {
+		if (pthread_create(&worker, NULL, walk_worker, NULL) != 0)
+			fatal_system_error("pthread_create");
+		pthread_detach(worker);
+	}
+}
+
+/* Queue every branch off trunk revision NODE */
+static Node *spawn_branches(struct rcs2git *g, Node *node)
+{
+	struct walk_task *t;
+	Node *b;
+
+	pthread_once(&walk_once, walk_start);
+	for (b = node->down; b; b = b->sib) {
+		t = xmalloc(sizeof(struct walk_task));
+		t->next = NULL;
+		t->file = g->file;
+		t->branch = b;
+		lines_share(&t->lines, &Glines);
+		t->base = Gbase;
+		if (t->base)
+			refs_inc(&t->base->refs);
+		pthread_mutex_lock(&walk_mutex);
+		g->file->tasks++;
+		*walk_tail = t;
+		walk_tail = &t->next;
+		pthread_cond_signal(&walk_work);
+		pthread_mutex_unlock(&walk_mutex);
+	}
+	return NULL;
+}
+
+/* Wait for F's branches, walking queued ones here meanwhile */
+static void walk_wait(struct walk_file *f)
+{
+	struct walk_task *t;
+
+	pthread_mutex_lock(&walk_mutex);
+	while (f->tasks) {
+		if ((t = walk_next())) {
+			pthread_mutex_unlock(&walk_mutex);
+			walk_branch(t);
+			pthread_mutex_lock(&walk_mutex);
+		} else
+			pthread_cond_wait(&walk_done, &walk_mutex);
+	}
+	pthread_mutex_unlock(&walk_mutex);
+}
+
+/*
+ * Check out every live revision of the file and, if STORE is set,
+ * write them to git as blobs. Returns the number of bytes checked out.
+ */
+unsigned long generate_files(cvs_context *ctx, int store)
+{
+	cvs_file *cvs = ctx->file;
+	int expand_override_enabled = 1;
+	struct walk_file file;
+	struct rcs2git state, *g = &state;
+	Node *node = ctx->nodes.head_node;
+
+	memset(&file, 0, sizeof(file));
+	file.ctx = ctx;
+	file.store = store;
+	if (cvs->expand && expand_override_enabled)
+		file.expand = expand_override(cvs->expand);
+	else	file.expand = EXPANDKK;
+	walk_init(g, &file);
+	g->spawn = checkout_jobs > 1;
+	if (g->input->stream)
+		spans_init(g, &ctx->nodes);
+	g->stack[0].node = node;
+	process_delta(g, node, ENTER);
+	walk(g, node);
+	/* branches may use lines from texts this walk unescaped */
+	walk_wait(&file);
+	blob_wait(&file.pending);
+	walk_fini(g);
+	return file.bytes;
 }
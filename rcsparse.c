@@ -0,0 +1,444 @@
+/*
+ *  Copyright © 2006 Keith Packard <keithp@keithp.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "cvs.h"
+
+/*
+ * Recursive-descent parser for ,v files. This accepts the language
+ * described by gram.y and lex.l and builds the same cvs_file, but
+ * reads straight from the input buffer instead of bouncing every
+ * token through the generated scanner and parser. Unknown phrases
+ * (newphrases in RCS terms) are skipped rather than rejected.
+ */
+
+int rcs_parser_fast = 0;
+
+#define RCS_NOT_NUMBER	0
+#define RCS_NUMBER	1
+#define RCS_BRAINDAMAGED 2
+
+static inline int
+rcs_is_space (char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' ||
+	   c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline int
+rcs_is_digit (char c)
+{
+    return '0' <= c && c <= '9';
+}
+
+static inline int
+rcs_is_alpha (char c)
+{
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
+
+/* [-a-zA-Z_+%] */
+static inline int
+rcs_is_name_start (char c)
+{
+    return rcs_is_alpha (c) || c == '-' || c == '_' || c == '+' || c == '%';
+}
+
+/* [-a-zA-Z_0-9+/%.] */
+static inline int
+rcs_is_name (char c)
+{
+    return rcs_is_name_start (c) || rcs_is_digit (c) || c == '/' || c == '.';
+}
+
+static int
+rcs_error (cvs_input *in, char *msg)
+{
+    fprintf (stderr, "%s: (%d) parse error: %s\n",
+	     in->name, cvs_input_line (in, in->ptr), msg);
+    return -1;
+}
+
+static void
+rcs_skip_space (cvs_input *in)
+{
+    char    *p = in->ptr;
+
+    while (p < in->end && rcs_is_space (*p))
+	p++;
+    in->ptr = p;
+}
+
+static int
+rcs_at (cvs_input *in, char c)
+{
+    rcs_skip_space (in);
+    return in->ptr < in->end && *in->ptr == c;
+}
+
+static int
+rcs_expect (cvs_input *in, char c, char *msg)
+{
+    if (!rcs_at (in, c))
+	return rcs_error (in, msg);
+    in->ptr++;
+    return 0;
+}
+
+/*
+ * Lower case keyword at the current position; the length is
+ * returned and the input is left untouched
+ */
+static int
+rcs_keyword (cvs_input *in, char **kw)
+{
+    char    *p;
+
+    rcs_skip_space (in);
+    *kw = p = in->ptr;
+    while (p < in->end && 'a' <= *p && *p <= 'z')
+	p++;
+    return p - *kw;
+}
+
+static inline int
+rcs_is (char *kw, int len, const char *name)
+{
+    return strlen (name) == len && !memcmp (kw, name, len);
+}
+
+/*
+ * [0-9]+\.[0-9.]* converted as lex_number does. A lone "1" is
+ * reported as RCS_BRAINDAMAGED, matching the scanner
+ */
+static int
+rcs_number (cvs_input *in, cvs_number *n)
+{
+    char    *p, *q, *e;
+    int	    v;
+
+    rcs_skip_space (in);
+    p = q = in->ptr;
+    while (q < in->end && rcs_is_digit (*q))
+	q++;
+    if (q == p)
+	return RCS_NOT_NUMBER;
+    if (q == in->end || *q != '.') {
+	if (q - p == 1 && *p == '1') {
+	    in->ptr = q;
+	    return RCS_BRAINDAMAGED;
+	}
+	return RCS_NOT_NUMBER;
+    }
+    for (e = q; e < in->end && (rcs_is_digit (*e) || *e == '.'); e++)
+	;
+    n->c = 0;
+    while (p < e && rcs_is_digit (*p) && n->c < CVS_MAX_DEPTH) {
+	for (v = 0; p < e && rcs_is_digit (*p); p++)
+	    v = v * 10 + (*p - '0');
+	n->n[n->c++] = v;
+	if (p < e && *p == '.')
+	    p++;
+    }
+    in->ptr = e;
+    return RCS_NUMBER;
+}
+
+/*
+ * NAME or NUMBER, as accepted by the 'name' production
+ */
+static char *
+rcs_name (cvs_input *in)
+{
+    char	*p, *q;
+    cvs_number	n;
+    char	name[CVS_MAX_REV_LEN];
+
+    rcs_skip_space (in);
+    p = q = in->ptr;
+    if (q < in->end && rcs_is_name_start (*q)) {
+	while (q < in->end && rcs_is_name (*q))
+	    q++;
+	in->ptr = q;
+	return atom_n (p, q - p);
+    }
+    if (rcs_number (in, &n) == RCS_NUMBER)
+	return atom (cvs_number_string (&n, name));
+    in->ptr = p;
+    return NULL;
+}
+
+/* commitid values are [0-9a-zA-Z]+ */
+static char *
+rcs_commitid (cvs_input *in)
+{
+    char    *p, *q;
+
+    rcs_skip_space (in);
+    p = q = in->ptr;
+    while (q < in->end && (rcs_is_alpha (*q) || rcs_is_digit (*q)))
+	q++;
+    if (q == p)
+	return NULL;
+    in->ptr = q;
+    return atom_n (p, q - p);
+}
+
+static char *
+rcs_data (cvs_input *in)
+{
+    if (!rcs_at (in, '@'))
+	return NULL;
+    in->ptr++;
+    return cvs_input_data (in);
+}
+
+/*
+ * Skip the remainder of a phrase, through the terminating ';'
+ */
+static int
+rcs_skip_phrase (cvs_input *in)
+{
+    char    *p;
+
+    for (;;) {
+	rcs_skip_space (in);
+	if (in->ptr == in->end)
+	    return rcs_error (in, "unterminated phrase");
+	p = in->ptr++;
+	if (*p == ';')
+	    return 0;
+	if (*p == '@')
+	    (void) cvs_input_text (in);
+    }
+}
+
+static int
+rcs_opt_number (cvs_input *in, cvs_number *n)
+{
+    n->c = 0;
+    if (rcs_at (in, ';'))
+	return 0;
+    if (rcs_number (in, n) != RCS_NUMBER)
+	return rcs_error (in, "expected revision number");
+    return 0;
+}
+
+static int
+rcs_symbols (cvs_context *ctx)
+{
+    cvs_input	*in = &ctx->input;
+    cvs_symbol	*symbols = NULL, *s;
+    cvs_number	n;
+    char	*name;
+    int		t;
+
+    while (!rcs_at (in, ';')) {
+	name = rcs_name (in);
+	if (!name)
+	    return rcs_error (in, "expected symbol name");
+	if (rcs_expect (in, ':', "expected ':'") < 0)
+	    return -1;
+	t = rcs_number (in, &n);
+	if (t == RCS_NUMBER) {
+	    s = cvs_arena_alloc (&ctx->arena, sizeof (cvs_symbol));
+	    s->name = name;
+	    s->number = n;
+	    s->next = symbols;
+	    symbols = s;
+	} else if (t == RCS_BRAINDAMAGED) {
+	    fprintf(stderr, "ignoring symbol %s (FreeBSD RELENG_2_1_0 braindamage?)\n", name);
+	} else
+	    return rcs_error (in, "expected symbol revision");
+    }
+    in->ptr++;
+    ctx->file->symbols = symbols;
+    return 0;
+}
+
+static int
+rcs_admin (cvs_context *ctx)
+{
+    cvs_input	*in = &ctx->input;
+    cvs_file	*cvs = ctx->file;
+    char    *kw;
+    int	    len;
+    char    *data;
+
+    for (;;) {
+	len = rcs_keyword (in, &kw);
+	if (!len || rcs_is (kw, len, "desc"))
+	    return 0;
+	in->ptr += len;
+	if (rcs_is (kw, len, "head")) {
+	    if (rcs_opt_number (in, &cvs->head) < 0)
+		return -1;
+	} else if (rcs_is (kw, len, "branch")) {
+	    if (rcs_opt_number (in, &cvs->branch) < 0)
+		return -1;
+	} else if (rcs_is (kw, len, "symbols")) {
+	    if (rcs_symbols (ctx) < 0)
+		return -1;
+	    continue;
+	} else if (rcs_is (kw, len, "expand")) {
+	    data = rcs_data (in);
+	    if (!data)
+		return rcs_error (in, "expected expand string");
+	    cvs->expand = data;
+	}
+	if (rcs_skip_phrase (in) < 0)
+	    return -1;
+    }
+}
+
+static int
+rcs_branches (cvs_context *ctx, cvs_version *v)
+{
+    cvs_input	*in = &ctx->input;
+    cvs_branch	**tail = &v->branches, *b;
+    cvs_number	n;
+
+    while (!rcs_at (in, ';')) {
+	if (rcs_number (in, &n) != RCS_NUMBER)
+	    return rcs_error (in, "expected branch number");
+	b = cvs_arena_alloc (&ctx->arena, sizeof (cvs_branch));
+	b->number = n;
+	hash_branch (&ctx->nodes, b);
+	*tail = b;
+	tail = &b->next;
+    }
+    return 0;
+}
+
+static int
+rcs_delta (cvs_context *ctx, cvs_version *v)
+{
+    cvs_input	*in = &ctx->input;
+    char	*kw;
+    int		len;
+    cvs_number	n;
+
+    for (;;) {
+	rcs_skip_space (in);
+	if (in->ptr == in->end || rcs_is_digit (*in->ptr))
+	    break;
+	len = rcs_keyword (in, &kw);
+	if (!len)
+	    return rcs_error (in, "expected delta phrase");
+	if (rcs_is (kw, len, "desc"))
+	    break;
+	in->ptr += len;
+	if (rcs_is (kw, len, "date")) {
+	    if (rcs_number (in, &n) != RCS_NUMBER)
+		return rcs_error (in, "expected date");
+	    v->date = lex_date (&n, ctx);
+	} else if (rcs_is (kw, len, "author")) {
+	    if (!(v->author = rcs_name (in)))
+		return rcs_error (in, "expected author");
+	} else if (rcs_is (kw, len, "state")) {
+	    if (!(v->state = rcs_name (in)))
+		return rcs_error (in, "expected state");
+	} else if (rcs_is (kw, len, "branches")) {
+	    if (rcs_branches (ctx, v) < 0)
+		return -1;
+	} else if (rcs_is (kw, len, "next")) {
+	    if (rcs_opt_number (in, &v->parent) < 0)
+		return -1;
+	} else if (rcs_is (kw, len, "commitid")) {
+	    if (!(v->commitid = rcs_commitid (in)))
+		return rcs_error (in, "expected commitid");
+	}
+	if (rcs_skip_phrase (in) < 0)
+	    return -1;
+    }
+    if (!v->author || !v->state)
+	return rcs_error (in, "incomplete delta");
+    v->dead = !strcmp (v->state, "dead");
+    return 0;
+}
+
+static int
+rcs_deltatext (cvs_input *in, cvs_patch *p)
+{
+    char    *kw;
+    int	    len;
+
+    for (;;) {
+	len = rcs_keyword (in, &kw);
+	if (!len)
+	    return rcs_error (in, "expected deltatext phrase");
+	in->ptr += len;
+	if (rcs_is (kw, len, "log")) {
+	    if (!(p->log = rcs_data (in)))
+		return rcs_error (in, "expected log string");
+	} else if (rcs_is (kw, len, "text")) {
+	    if (!rcs_at (in, '@'))
+		return rcs_error (in, "expected text string");
+	    in->ptr++;
+	    p->text = cvs_input_text (in);
+	    break;
+	} else if (rcs_skip_phrase (in) < 0)
+	    return -1;
+    }
+    if (!p->log)
+	return rcs_error (in, "missing log");
+    return 0;
+}
+
+int
+rcs_parse (cvs_context *ctx)
+{
+    cvs_input	*in = &ctx->input;
+    cvs_file	*cvs = ctx->file;
+    cvs_version	**vtail = &cvs->versions, *v;
+    cvs_patch	**ptail = &cvs->patches, *p;
+    cvs_number	n;
+    char	*kw;
+    int		len;
+
+    if (rcs_admin (ctx) < 0)
+	return -1;
+    while (rcs_number (in, &n) == RCS_NUMBER) {
+	v = cvs_arena_alloc (&ctx->arena, sizeof (cvs_version));
+	v->number = n;
+	if (rcs_delta (ctx, v) < 0)
+	    return -1;
+	hash_version (&ctx->nodes, v);
+	++cvs->nversions;
+	*vtail = v;
+	vtail = &v->next;
+    }
+    len = rcs_keyword (in, &kw);
+    if (!rcs_is (kw, len, "desc"))
+	return rcs_error (in, "expected desc");
+    in->ptr += len;
+    if (!rcs_data (in))
+	return rcs_error (in, "expected desc string");
+    while (rcs_number (in, &n) == RCS_NUMBER) {
+	p = cvs_arena_alloc (&ctx->arena, sizeof (cvs_patch));
+	p->number = n;
+	if (rcs_deltatext (in, p) < 0)
+	    return -1;
+	hash_patch (&ctx->nodes, p);
+	*ptail = p;
+	ptail = &p->next;
+    }
+    rcs_skip_space (in);
+    if (in->ptr != in->end)
+	return rcs_error (in, "trailing garbage");
+    return 0;
+}
@@ -21,36 +21,49 @@
 #define DEBUG 0
 
 /*
- * Given a single-file tree, locate the specific version number
+ * Record in each revision's node the commit reachable from the
+ * heads, once the vendor branch has been patched in and the set
+ * of commits in the tree is final
  */
 
-static rev_commit *
-rev_find_cvs_commit (rev_list *rl, cvs_number *number)
+static void
+rev_list_index_commits (rev_list *rl, node_hash *nodes)
 {
     rev_ref	*h;
     rev_commit	*c;
-    rev_file	*f;
+    Node	*node;
 
     for (h = rl->heads; h; h = h->next) {
 	if (h->tail)
 	    continue;
 	for (c = h->commit; c; c = c->parent)
 	{
-	     f = c->file;
-	     if (cvs_number_compare (&f->number, number) == 0)
-		    return c;
+	     node = node_find (nodes, &c->file->number);
+	     if (node && !node->commit)
+		 node->commit = c;
 	     if (c->tail)
 		 break;
 	}
     }
-    return NULL;
+}
+
+/*
+ * Given a single-file tree, locate the specific version number
+ */
+
+static rev_commit *
+rev_find_cvs_commit (node_hash *nodes, cvs_number *number)
+{
+    Node	*node = node_find (nodes, number);
+
+    return node ? node->commit : NULL;
 }
 
 /*
  * Construct a branch using CVS revision numbers
  */
 static rev_commit *
-rev_branch_cvs (cvs_file *cvs, cvs_number *branch)
+rev_branch_cvs (cvs_file *cvs, node_hash *nodes, cvs_number *branch)
 {
     cvs_number	n;
     rev_commit	*head = NULL;
@@ -59,7 +72,7 @@ rev_branch_cvs (cvs_file *cvs, cvs_number *branch)
 
     n = *branch;
     n.n[n.c-1] = -1;
-    for (node = cvs_find_version (cvs, &n); node; node = node->next) {
+    for (node = cvs_find_version (cvs, nodes, &n); node; node = node->next) {
 	cvs_version *v = node->v;
 	cvs_patch *p = node->p;
 	rev_commit *c;
@@ -291,13 +304,27 @@ rev_list_patch_vendor_branch (rev_list *rl, cvs_file *cvs)
  */
 
 static void
-rev_list_graft_branches (rev_list *rl, cvs_file *cvs)
+rev_list_graft_branches (rev_list *rl, cvs_file *cvs, node_hash *nodes)
 {
     rev_ref	*h;
     rev_commit	*c;
     cvs_version	*cv;
     cvs_branch	*cb;
+    Node	*node;
 
+    /*
+     * Note where each branch starts, preferring the first version
+     * in the file which lists the branch and is in the tree.
+     * Note that in the presense of vendor branches, the
+     * branch location may actually be out on that vendor branch
+     */
+    for (cv = cvs->versions; cv; cv = cv->next)
+	for (cb = cv->branches; cb; cb = cb->next)
+	    if ((node = node_find (nodes, &cb->number))) {
+		node->branched = 1;
+		if (!node->graft)
+		    node->graft = rev_find_cvs_commit (nodes, &cv->number);
+	    }
     /*
      * Glue branches together
      */
@@ -321,140 +348,224 @@ rev_list_graft_branches (rev_list *rl, cvs_file *cvs)
 		break;
 	    }
 	if (c) {
-	    /*
-	     * Walk the version tree, looking for the branch location.
-	     * Note that in the presense of vendor branches, the
-	     * branch location may actually be out on that vendor branch
-	     */
-	    for (cv = cvs->versions; cv; cv = cv->next) {
-		for (cb = cv->branches; cb; cb = cb->next) {
-		    if (cvs_number_compare (&cb->number,
-					    &c->file->number) == 0)
-		    {
-			c->parent = rev_find_cvs_commit (rl, &cv->number);
-			c->tail = 1;
-			break;
-		    }
-		}
-		if (c->parent)
-		{
-#if 0
-		    /*
-		     * check for a parallel vendor branch
-		     */
-		    for (cb = cv->branches; cb; cb = cb->next) {
-			if (cvs_is_vendor (&cb->number)) {
-			    cvs_number	v_n;
-			    rev_commit	*v_c, *n_v_c;
-			    fprintf (stderr, "Found merge into vendor branch\n");
-			    v_n = cb->number;
-			    v_c = NULL;
-			    /*
-			     * Walk to head of vendor branch
-			     */
-			    while ((n_v_c = rev_find_cvs_commit (rl, &v_n)))
-			    {
-				/*
-				 * Stop if we reach a date after the
-				 * branch version date
-				 */
-				if (time_compare (n_v_c->date, c->date) > 0)
-				    break;
-				v_c = n_v_c;
-				v_n.n[v_n.c - 1]++;
-			    }
-			    if (v_c)
-			    {
-				fprintf (stderr, "%s: rewrite branch", cvs->name);
-				dump_number_file (stderr, " branch point",
-						  &v_c->file->number);
-				dump_number_file (stderr, " branch version",
-						  &c->file->number);
-				fprintf (stderr, "\n");
-				c->parent = v_c;
-			    }
-			}
-		    }
-#endif
-		    break;
-		}
+	    node = node_find (nodes, &c->file->number);
+	    if (node && node->branched) {
+		c->parent = node->graft;
+		c->tail = 1;
 	    }
 	}
     }
 }
 
+/*
+ * The heads of one file, indexed by branch. Each branch maps to
+ * the first head in the list on that branch, which is the one a
+ * search of the list with cvs_same_branch would find
+ */
+typedef struct _rev_head_entry {
+    cvs_number		branch;
+    rev_ref		*head;
+} rev_head_entry;
+
+typedef struct _rev_head_index {
+    rev_head_entry	*table;
+    int			size;
+    int			count;
+    rev_ref		**tail;		/* end of rl->heads */
+} rev_head_index;
+
+#define REV_HEAD_INDEX_MIN  64
+
+/*
+ * Reduce a revision or branch number to its branch, so that
+ * numbers for which cvs_same_branch is true share a key
+ */
+static cvs_number
+rev_branch_key (cvs_number *n)
+{
+    cvs_number	key;
+    int		i;
+
+    if (n->c <= 2) {
+	/* all of trunk is one branch */
+	key.c = n->c ? 1 : 0;
+	key.n[0] = 0;
+	return key;
+    }
+    if (n->c & 1)
+	return *n;
+    key.c = n->c - 1;
+    for (i = 0; i < key.c; i++)
+	key.n[i] = n->n[i];
+    /* n.m.0.p is the magic number of branch n.m.p */
+    if (key.n[key.c-1] == 0)
+	key.n[key.c-1] = n->n[n->c-1];
+    return key;
+}
+
+static rev_head_entry *
+rev_head_slot (rev_head_index *ix, cvs_number *key)
+{
+    unsigned	mask = ix->size - 1;
+    unsigned	i = cvs_number_hash (key) & mask;
+    rev_head_entry  *e;
+
+    while ((e = &ix->table[i])->head &&
+	   (e->branch.c != key->c ||
+	    memcmp (e->branch.n, key->n, key->c * sizeof (key->n[0]))))
+	i = (i + 1) & mask;
+    return e;
+}
+
+static rev_ref *
+rev_head_find (rev_head_index *ix, cvs_number *n)
+{
+    cvs_number	key = rev_branch_key (n);
+
+    if (!ix->size)
+	return NULL;
+    return rev_head_slot (ix, &key)->head;
+}
+
+/*
+ * Index h under the branch of n, unless an earlier head is already there
+ */
+static void
+rev_head_insert (rev_head_index *ix, cvs_number *n, rev_ref *h)
+{
+    cvs_number	    key = rev_branch_key (n);
+    rev_head_entry  *old = ix->table, *e;
+    int		    size = ix->size;
+    int		    i;
+
+    if (!key.c)
+	return;
+    if (ix->count * 2 >= ix->size) {
+	ix->size = size ? size * 2 : REV_HEAD_INDEX_MIN;
+	ix->table = calloc (ix->size, sizeof (rev_head_entry));
+	for (i = 0; i < size; i++)
+	    if (old[i].head)
+		*rev_head_slot (ix, &old[i].branch) = old[i];
+	free (old);
+    }
+    e = rev_head_slot (ix, &key);
+    if (!e->head) {
+	e->branch = key;
+	e->head = h;
+	ix->count++;
+    }
+}
+
+static void
+rev_head_index_free (rev_head_index *ix)
+{
+    free (ix->table);
+    ix->table = NULL;
+    ix->size = 0;
+    ix->count = 0;
+}
+
+/*
+ * Heads are appended to a file's list through a tail pointer, as
+ * rev_list_add_head would walk the whole list each time
+ */
+static rev_ref *
+rev_head_append (rev_ref ***tail, rev_commit *commit, char *name, int degree)
+{
+    rev_ref	*r = calloc (1, sizeof (rev_ref));
+
+    r->commit = commit;
+    r->name = name;
+    r->degree = degree;
+    **tail = r;
+    *tail = &r->next;
+    return r;
+}
+
+static rev_ref *
+rev_head_add (rev_head_index *ix, rev_commit *commit, char *name, int degree)
+{
+    rev_ref	*r = rev_head_append (&ix->tail, commit, name, degree);
+
+    rev_head_insert (ix, &commit->file->number, r);
+    return r;
+}
+
 /*
  * For each symbol, locate the appropriate commit
  */
 
 static rev_ref *
-rev_list_find_branch (rev_list *rl, cvs_number *number)
+rev_list_find_branch (rev_head_index *ix, cvs_number *number)
 {
     cvs_number	n;
     rev_ref	*h;
 
-    if (number->c < 2)
-	return NULL;
     n = *number;
-    h = NULL;
     while (n.c >= 2)
     {
-	for (h = rl->heads; h; h = h->next) {
-	    if (cvs_same_branch (&h->number, &n)) {
-		break;
-	    }
-	}
-	if (h)
-	    break;
+	if ((h = rev_head_find (ix, &n)))
+	    return h;
 	n.c -= 2;
     }
-    return h;
+    return NULL;
 }
 
 static void
-rev_list_set_refs (rev_list *rl, cvs_file *cvs)
+rev_list_set_refs (rev_list *rl, cvs_file *cvs, node_hash *nodes)
 {
     rev_ref	*h;
     cvs_symbol	*s;
     rev_commit	*c;
-    
+    rev_tag	*t, **tail = &rl->tags;
+    rev_head_index  ix = { NULL, 0, 0, &rl->heads };
+
+    /*
+     * Index heads by the branch of their newest commit
+     */
+    for (; (h = *ix.tail); ix.tail = &h->next)
+	if (h->commit)
+	    rev_head_insert (&ix, &h->commit->file->number, h);
     /*
      * Locate a symbolic name for this head
      */
     for (s = cvs->symbols; s; s = s->next) {
 	c = NULL;
 	if (cvs_is_head (&s->number)) {
-	    for (h = rl->heads; h; h = h->next) {
-		if (cvs_same_branch (&h->commit->file->number, &s->number))
-		    break;
-	    }
+	    h = rev_head_find (&ix, &s->number);
 	    if (h) {
 		if (!h->name) {
 		    h->name = s->name;
 		    h->degree = cvs_number_degree (&s->number);
 		} else
-		    h = rev_list_add_head (rl, h->commit, s->name,
-					   cvs_number_degree (&s->number));
+		    h = rev_head_add (&ix, h->commit, s->name,
+				      cvs_number_degree (&s->number));
 	    } else {
 		cvs_number	n;
 
 		n = s->number;
 		while (n.c >= 4) {
 		    n.c -= 2;
-		    c = rev_find_cvs_commit (rl, &n);
+		    c = rev_find_cvs_commit (nodes, &n);
 		    if (c)
 			break;
 		}
 		if (c)
-		    h = rev_list_add_head (rl, c, s->name,
-					   cvs_number_degree (&s->number));
+		    h = rev_head_add (&ix, c, s->name,
+				      cvs_number_degree (&s->number));
 	    }
 	    if (h)
 		h->number = s->number;
 	} else {
-	    c = rev_find_cvs_commit (rl, &s->number);
-	    if (c)
-		tag_commit(c, s->name);
+	    c = rev_find_cvs_commit (nodes, &s->number);
+	    if (c) {
+		t = calloc (1, sizeof (rev_tag));
+		t->commit = c;
+		t->name = s->name;
+		t->file = cvs->name;
+		*tail = t;
+		tail = &t->next;
+	    }
 	}
     }
     /*
@@ -481,15 +592,19 @@ rev_list_set_refs (rev_list *rl, cvs_file *cvs)
 	/* compute name after patching parents */
     }
     /*
-     * Link heads together in a tree
+     * Link heads together in a tree, now indexing them by
+     * their own branch numbers
      */
+    rev_head_index_free (&ix);
+    for (h = rl->heads; h; h = h->next)
+	rev_head_insert (&ix, &h->number, h);
     for (h = rl->heads; h; h = h->next) {
 	cvs_number	n;
 
 	if (h->number.c >= 4) {
 	    n = h->number;
 	    n.c -= 2;
-	    h->parent = rev_list_find_branch (rl, &n);
+	    h->parent = rev_list_find_branch (&ix, &n);
 	    if (!h->parent && ! cvs_is_vendor (&h->number))
 		fprintf (stderr, "Warning: %s: branch %s has no parent\n",
 			 cvs->name, h->name);
@@ -505,6 +620,19 @@ rev_list_set_refs (rev_list *rl, cvs_file *cvs)
 	    h->name = atom (name);
 	}
     }
+    rev_head_index_free (&ix);
+}
+
+void
+rev_list_tag_commits (rev_list *rl)
+{
+    rev_tag	*t;
+
+    while ((t = rl->tags)) {
+	rl->tags = t->next;
+	tag_commit (t->commit, t->name, t->file);
+	free (t);
+    }
 }
 
 /*
@@ -543,15 +671,55 @@ rev_order_compare (cvs_number *a, cvs_number *b)
 }
 #endif
 
-static cvs_symbol *
-cvs_find_symbol (cvs_file *cvs, char *name)
+/*
+ * Symbols of a file by name. Names are atoms, so they
+ * hash and compare as pointers
+ */
+typedef struct _cvs_symbol_index {
+    cvs_symbol		**table;
+    unsigned		mask;
+} cvs_symbol_index;
+
+static cvs_symbol **
+cvs_symbol_slot (cvs_symbol_index *ix, char *name)
 {
-    cvs_symbol	*s;
+    uint32_t	h = (uint32_t) ((uintptr_t) name >> 3) * 0x9e3779b1;
+    unsigned	i = (h ^ (h >> 16)) & ix->mask;
+
+    while (ix->table[i] && ix->table[i]->name != name)
+	i = (i + 1) & ix->mask;
+    return &ix->table[i];
+}
+
+/*
+ * Index the first symbol of each name, as a search of the list would find
+ */
+static void
+cvs_symbol_index_build (cvs_symbol_index *ix, cvs_file *cvs)
+{
+    cvs_symbol	*s, **slot;
+    unsigned	size = 16;
+    int		n = 0;
 
     for (s = cvs->symbols; s; s = s->next)
-	if (s->name == name)
-	    return s;
-    return NULL;
+	n++;
+    while (size < n * 2)
+	size *= 2;
+    ix->table = calloc (size, sizeof (cvs_symbol *));
+    ix->mask = size - 1;
+    for (s = cvs->symbols; s; s = s->next) {
+	slot = cvs_symbol_slot (ix, s->name);
+	if (!*slot)
+	    *slot = s;
+    }
+}
+
+static cvs_symbol *
+cvs_find_symbol (cvs_symbol_index *ix, char *name)
+{
+    if (!name)
+	return NULL;
+    return *cvs_symbol_slot (ix, name);
 }
 
 static int
@@ -575,26 +743,57 @@ rev_list_dump_ref_parents (FILE *f, rev_ref *h)
     }
 }
 
+typedef struct _rev_head_sort {
+    rev_ref		*head;
+    cvs_symbol		*symbol;
+    int			order;
+} rev_head_sort;
+
+static int
+rev_head_sort_compare (const void *a, const void *b)
+{
+    const rev_head_sort	*ha = a, *hb = b;
+    int			r;
+
+    r = cvs_symbol_compare (ha->symbol, hb->symbol);
+    if (r)
+	return r;
+    return ha->order - hb->order;
+}
+
+/*
+ * Order heads by the number of their symbol, those without one
+ * first. Heads which compare equal keep their relative order
+ */
 static void
 rev_list_sort_heads (rev_list *rl, cvs_file *cvs)
 {
-    rev_ref	*h, **hp;
-    cvs_symbol	*hs, *hns;
-
-    for (hp = &rl->heads; (h = *hp);) {
-	if (!h->next)
-	    break;
-	hs = cvs_find_symbol (cvs, h->name);
-	hns = cvs_find_symbol (cvs, h->next->name);
-	if (cvs_symbol_compare (hs, hns) > 0) {
-	    *hp = h->next;
-	    h->next = h->next->next;
-	    (*hp)->next = h;
-	    hp = &rl->heads;
-	} else {
-	    hp = &h->next;
-	}
+    rev_ref		*h, **hp;
+    cvs_symbol_index	ix;
+    rev_head_sort	*sort;
+    int			n, i;
+
+    n = 0;
+    for (h = rl->heads; h; h = h->next)
+	n++;
+    if (n < 2)
+	return;
+    cvs_symbol_index_build (&ix, cvs);
+    sort = calloc (n, sizeof (rev_head_sort));
+    for (h = rl->heads, i = 0; h; h = h->next, i++) {
+	sort[i].head = h;
+	sort[i].symbol = cvs_find_symbol (&ix, h->name);
+	sort[i].order = i;
+    }
+    qsort (sort, n, sizeof (rev_head_sort), rev_head_sort_compare);
+    hp = &rl->heads;
+    for (i = 0; i < n; i++) {
+	*hp = sort[i].head;
+	hp = &sort[i].head->next;
     }
+    *hp = NULL;
+    free (sort);
+    free (ix.table);
 #if DEBUG
     fprintf (stderr, "Sorted heads for %s\n", cvs->name);
     for (h = rl->heads; h;) {
@@ -608,18 +807,19 @@ rev_list_sort_heads (rev_list *rl, cvs_file *cvs)
 }
 
 rev_list *
-rev_list_cvs (cvs_file *cvs)
+rev_list_cvs (cvs_context *ctx)
 {
+    cvs_file	*cvs = ctx->file;
     rev_list	*rl = calloc (1, sizeof (rev_list));
     cvs_number	trunk_number;
     rev_commit	*trunk; 
     rev_commit	*branch;
     cvs_version	*cv;
     cvs_branch	*cb;
-    rev_ref	*t;
+    rev_ref	*t, **tail = &rl->heads;
     cvs_version	*ctrunk = NULL;
 
-    build_branches();
+    build_branches(&ctx->nodes);
     /*
      * Locate first revision on trunk branch
      */
@@ -638,9 +838,9 @@ rev_list_cvs (cvs_file *cvs)
 	trunk_number = ctrunk->number;
     else
 	trunk_number = lex_number ("1.1");
-    trunk = rev_branch_cvs (cvs, &trunk_number);
+    trunk = rev_branch_cvs (cvs, &ctx->nodes, &trunk_number);
     if (trunk) {
-	t = rev_list_add_head (rl, trunk, atom ("master"), 2);
+	t = rev_head_append (&tail, trunk, atom ("master"), 2);
 	t->number = trunk_number;
     }
     /*
@@ -653,14 +853,16 @@ rev_list_cvs (cvs_file *cvs)
     for (cv = cvs->versions; cv; cv = cv->next) {
 	for (cb = cv->branches; cb; cb = cb->next)
 	{
-	    branch = rev_branch_cvs (cvs, &cb->number);
-	    rev_list_add_head (rl, branch, NULL, 0);
+	    branch = rev_branch_cvs (cvs, &ctx->nodes, &cb->number);
+	    rev_head_append (&tail, branch, NULL, 0);
 	}
     }
-    generate_files(cvs);
+    if (!ctx->skip_blobs)
+	generate_files(ctx, 1);
     rev_list_patch_vendor_branch (rl, cvs);
-    rev_list_graft_branches (rl, cvs);
-    rev_list_set_refs (rl, cvs);
+    rev_list_index_commits (rl, &ctx->nodes);
+    rev_list_graft_branches (rl, cvs, &ctx->nodes);
+    rev_list_set_refs (rl, cvs, &ctx->nodes);
     rev_list_sort_heads (rl, cvs);
     rev_list_set_tail (rl);
     rev_list_free_dead_files (rl);
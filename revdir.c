@@ -20,7 +20,8 @@
 static int
 compare_names (const void *a, const void *b)
 {
-    const rev_file	*af = a, *bf = b;
+    const rev_file	*af = *(const rev_file **) a;
+    const rev_file	*bf = *(const rev_file **) b;
 
     return strcmp (af->name, bf->name);
 }
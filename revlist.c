@@ -17,6 +17,7 @@
  */
 
 #include "cvs.h"
+#include <limits.h>
 
 /*
  * Add head refs
@@ -39,6 +40,7 @@ rev_list_add_head (rev_list *rl, rev_commit *commit, char *name, int degree)
     return r;
 }
 
+#if UNUSED
 static rev_ref *
 rev_find_head (rev_list *rl, char *name)
 {
@@ -49,11 +51,41 @@ rev_find_head (rev_list *rl, char *name)
 	    return h;
     return NULL;
 }
+#endif
+
+/*
+ * Total order on rev_file objects which doesn't depend on where
+ * they were allocated; files loaded by different threads must
+ * still come out in the same order. NULL sorts first. Only
+ * duplicates of the same revision fall back to the address.
+ */
+static int
+rev_file_order (rev_file *af, rev_file *bf)
+{
+    int	t;
+
+    if (af == bf)
+	return 0;
+    if (!af)
+	return -1;
+    if (!bf)
+	return 1;
+    if (af->name != bf->name) {
+	t = strcmp (af->name, bf->name);
+	if (t)
+	    return t;
+    }
+    t = cvs_number_compare (&af->number, &bf->number);
+    if (t)
+	return t;
+    if ((uintptr_t) af > (uintptr_t) bf)
+	return 1;
+    return -1;
+}
 
 /*
  * We keep all file lists in a canonical sorted order,
- * first by latest date and then by the address of the rev_file object
- * (which are always unique)
+ * first by latest date and then by file name and revision
  */
 
 int
@@ -73,7 +105,7 @@ rev_file_later (rev_file *af, rev_file *bf)
 	return 1;
     if (t < 0)
 	return 0;
-    if ((uintptr_t) af > (uintptr_t) bf)
+    if (rev_file_order (af, bf) > 0)
 	return 1;
     return 0;
 }
@@ -85,6 +117,11 @@ rev_commit_later (rev_commit *a, rev_commit *b)
 
     assert (a != b);
     t = time_compare (a->date, b->date);
+    if (t > 0)
+	return 1;
+    if (t < 0)
+	return 0;
+    t = rev_file_order (a->file, b->file);
     if (t > 0)
 	return 1;
     if (t < 0)
@@ -253,64 +290,242 @@ rev_ref_sel_sort (rev_ref *r)
 }
 #endif
 
-static rev_ref *
-rev_ref_find_name (rev_ref *h, char *name)
+/*
+ * The heads of the merged list by name, each with the head of that
+ * name from every file which has one, in file order. Built in one
+ * pass over the files, it stands in for searching each file's list
+ * for every merged head.
+ */
+typedef struct _rev_name_entry {
+    char		*name;
+    rev_ref		*head;
+    rev_ref		**refs;
+    int			nref;
+    int			sref;
+} rev_name_entry;
+
+typedef struct _rev_name_index {
+    rev_name_entry	*table;
+    int			size;
+    int			count;
+} rev_name_index;
+
+#define REV_NAME_INDEX_MIN  64
+
+static rev_name_entry *
+rev_name_slot (rev_name_index *ix, char *name)
 {
-    for (; h; h = h->next)
-	if (h->name == name)
-	    return h;
-    return NULL;
+    unsigned	mask = ix->size - 1;
+    uintptr_t	h = (uintptr_t) name;
+    unsigned	i = (unsigned) (h ^ (h >> 7) ^ (h >> 17)) & mask;
+    rev_name_entry  *e;
+
+    while ((e = &ix->table[i])->name && e->name != name)
+	i = (i + 1) & mask;
+    return e;
+}
+
+static rev_name_entry *
+rev_name_find (rev_name_index *ix, char *name)
+{
+    rev_name_entry  *e;
+
+    if (!ix->size)
+	return NULL;
+    e = rev_name_slot (ix, name);
+    return e->name ? e : NULL;
+}
+
+/*
+ * Find the entry for name, making an empty one if there is none
+ */
+static rev_name_entry *
+rev_name_insert (rev_name_index *ix, char *name)
+{
+    rev_name_entry  *old = ix->table, *e;
+    int		    size = ix->size;
+    int		    i;
+
+    if (ix->count * 2 >= ix->size) {
+	ix->size = size ? size * 2 : REV_NAME_INDEX_MIN;
+	ix->table = calloc (ix->size, sizeof (rev_name_entry));
+	for (i = 0; i < size; i++)
+	    if (old[i].name)
+		*rev_name_slot (ix, old[i].name) = old[i];
+	free (old);
+    }
+    e = rev_name_slot (ix, name);
+    if (!e->name) {
+	e->name = name;
+	ix->count++;
+    }
+    return e;
+}
+
+static void
+rev_name_add_ref (rev_name_entry *e, rev_ref *r)
+{
+    if (e->nref == e->sref) {
+	e->sref = e->sref ? e->sref * 2 : 4;
+	e->refs = realloc (e->refs, e->sref * sizeof (rev_ref *));
+    }
+    e->refs[e->nref++] = r;
+}
+
+static void
+rev_name_index_free (rev_name_index *ix)
+{
+    int	i;
+
+    for (i = 0; i < ix->size; i++)
+	free (ix->table[i].refs);
+    free (ix->table);
+    ix->table = NULL;
+    ix->size = 0;
+    ix->count = 0;
+}
+
+/*
+ * Min-heap of head positions; Kahn's algorithm takes the earliest
+ * ready head each time, as the original scan of the list did
+ */
+static void
+rev_index_push (int *heap, int *nheap, int v)
+{
+    int	i = (*nheap)++;
+
+    while (i > 0 && heap[(i - 1) / 2] > v) {
+	heap[i] = heap[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    heap[i] = v;
 }
 
 static int
-rev_ref_is_ready (char *name, rev_list *source, rev_ref *ready)
+rev_index_pop (int *heap, int *nheap)
 {
-    for (; source; source = source->next) {
-	rev_ref *head = rev_find_head(source, name);
-	if (head) {
-	    if (head->parent && !rev_ref_find_name(ready, head->parent->name))
-		    return 0;
-	}
+    int	top = heap[0];
+    int	v = heap[--(*nheap)];
+    int	i = 0, child;
+
+    while ((child = 2 * i + 1) < *nheap) {
+	if (child + 1 < *nheap && heap[child + 1] < heap[child])
+	    child++;
+	if (heap[child] >= v)
+	    break;
+	heap[i] = heap[child];
+	i = child;
     }
-    return 1;
+    heap[i] = v;
+    return top;
 }
 
+/*
+ * Order heads so each follows every branch it sprouts from in any
+ * file, and set each head's parent to the deepest of those
+ * branches. The branch graph is gathered once from the file heads
+ * recorded in the index, then walked with Kahn's algorithm; parents
+ * are all placed before a head, so its depth is known when it is.
+ */
 static rev_ref *
-rev_ref_tsort (rev_ref *refs, rev_list *head)
+rev_ref_tsort (rev_ref *refs, rev_name_index *ix)
 {
-    rev_ref *done = NULL;
-    rev_ref **done_tail = &done;
-    rev_ref *r, **prev;
-
-//    fprintf (stderr, "Tsort refs:\n");
-    while (refs) {
-	for (prev = &refs; (r = *prev); prev = &(*prev)->next) {
-	    if (rev_ref_is_ready (r->name, head, done)) {
-		break;
+    rev_ref	    *done = NULL;
+    rev_ref	    **done_tail = &done;
+    rev_ref	    **heads, *r, *sh, *p, *max;
+    rev_name_entry  *e;
+    int		    nhead = 0, nedge = 0, sedge = 0, ndone = 0, nready = 0;
+    int		    *index, *stamp, *first, *parents = NULL;
+    int		    *nchild, *cfirst, *children, *pending, *ready;
+    int		    i, j, n;
+
+    for (r = refs; r; r = r->next)
+	nhead++;
+    heads = calloc (nhead + 1, sizeof (rev_ref *));
+    index = calloc (ix->size + 1, sizeof (int));
+    stamp = calloc (nhead + 1, sizeof (int));
+    first = calloc (nhead + 1, sizeof (int));
+    nchild = calloc (nhead + 1, sizeof (int));
+    cfirst = calloc (nhead + 1, sizeof (int));
+    pending = calloc (nhead + 1, sizeof (int));
+    ready = calloc (nhead + 1, sizeof (int));
+    for (r = refs, i = 0; r; r = r->next, i++) {
+	heads[i] = r;
+	index[rev_name_find (ix, r->name) - ix->table] = i;
+    }
+    /*
+     * Parents of each head, once each, in the order the files
+     * name them
+     */
+    for (i = 0; i < nhead; i++) {
+	first[i] = nedge;
+	e = rev_name_find (ix, heads[i]->name);
+	for (n = 0; n < e->nref; n++) {
+	    sh = e->refs[n];
+	    if (!sh->parent)
+		continue;
+	    j = index[rev_name_find (ix, sh->parent->name) - ix->table];
+	    if (stamp[j] == i + 1)
+		continue;
+	    stamp[j] = i + 1;
+	    if (nedge == sedge) {
+		sedge = sedge ? sedge * 2 : 64;
+		parents = realloc (parents, sedge * sizeof (int));
 	    }
+	    parents[nedge++] = j;
+	    nchild[j]++;
+	    pending[i]++;
 	}
-	if (!r) {
-	    fprintf (stderr, "Error: branch cycle\n");
-	    return NULL;
+    }
+    first[nhead] = nedge;
+    /* and the heads sprouting from each */
+    children = calloc (nedge + 1, sizeof (int));
+    for (i = 1; i < nhead; i++)
+	cfirst[i] = cfirst[i - 1] + nchild[i - 1];
+    memset (nchild, 0, nhead * sizeof (int));
+    for (i = 0; i < nhead; i++)
+	for (n = first[i]; n < first[i + 1]; n++) {
+	    j = parents[n];
+	    children[cfirst[j] + nchild[j]++] = i;
+	}
+
+    for (i = 0; i < nhead; i++)
+	if (!pending[i])
+	    rev_index_push (ready, &nready, i);
+    while (nready) {
+	i = rev_index_pop (ready, &nready);
+	r = heads[i];
+	max = NULL;
+	for (n = first[i]; n < first[i + 1]; n++) {
+	    p = heads[parents[n]];
+	    if (!max || p->depth > max->depth)
+		max = p;
 	}
-	*prev = r->next;
+	r->parent = max;
+	r->depth = max ? max->depth + 1 : 1;
 	*done_tail = r;
-//	fprintf (stderr, "\t%s\n", r->name);
 	r->next = NULL;
 	done_tail = &r->next;
+	ndone++;
+	for (n = cfirst[i]; n < cfirst[i] + nchild[i]; n++)
+	    if (--pending[children[n]] == 0)
+		rev_index_push (ready, &nready, children[n]);
     }
-    return done;
-}
-
-static int
-rev_list_count (rev_list *head)
-{
-    int	count = 0;
-    while (head) {
-	count++;
-	head = head->next;
+    if (ndone != nhead) {
+	fprintf (stderr, "Error: branch cycle\n");
+	done = NULL;
     }
-    return count;
+    free (heads);
+    free (index);
+    free (stamp);
+    free (first);
+    free (parents);
+    free (nchild);
+    free (cfirst);
+    free (children);
+    free (pending);
+    free (ready);
+    return done;
 }
 
 static int
@@ -348,13 +563,9 @@ rev_commit_date_compare (const void *av, const void *bv)
     if (t)
 	return t;
     /*
-     * Ensure total order by ordering based on file address
+     * Ensure total order by ordering based on file name and revision
      */
-    if ((uintptr_t) a->file > (uintptr_t) b->file)
-	return -1;
-    if ((uintptr_t) a->file < (uintptr_t) b->file)
-	return 1;
-    return 0;
+    return -rev_file_order (a->file, b->file);
 }
 
 static int
@@ -491,12 +702,358 @@ rev_commit_is_ancestor (rev_commit *old, rev_commit *young)
 }
 #endif
 
+/*
+ * Index of the merged branches, used to find where branches and
+ * tags attach without walking whole branches. Each branch adds the
+ * run of commits it introduces once it is merged, ending where it
+ * joins commits already indexed; the history from any commit is
+ * then a series of runs. Commits are found in their run by what
+ * rev_commit_match compares: the commitid, or else log and author
+ * in buckets one time window wide, so a match lies in one of three
+ * buckets. A tree of minimum dates over each run finds the first
+ * commit at or before a date.
+ */
+typedef struct _rev_run {
+    rev_ref	*head;
+    rev_commit	**commits;
+    int		ncommit;
+    time_t	*dates;		/* minimum date tree, leaves at size */
+    int		size;
+} rev_run;
+
+typedef struct _rev_run_pos {
+    rev_commit	*commit;
+    int		run;
+    int		pos;
+} rev_run_pos;
+
+typedef struct _rev_match {
+    struct _rev_match	*next;
+    char		*commitid;
+    char		*log;
+    char		*author;
+    long		bucket;
+    int			*run;		/* ascending run, then pos */
+    int			*pos;
+    int			n;
+    int			size;
+} rev_match;
+
+typedef struct _rev_commit_index {
+    rev_run	*runs;
+    int		nrun;
+    int		srun;
+    rev_run_pos	*table;
+    int		tsize;
+    int		tcount;
+    rev_match	**hash;
+    int		nhash;
+    int		nmatch;
+} rev_commit_index;
+
+static rev_commit_index	commit_index;
+
+static unsigned
+rev_ptr_hash (void *p)
+{
+    uintptr_t	h = (uintptr_t) p;
+
+    return (unsigned) (h ^ (h >> 7) ^ (h >> 17));
+}
+
+static rev_run_pos *
+rev_run_slot (rev_commit_index *ci, rev_commit *c)
+{
+    unsigned	mask = ci->tsize - 1;
+    unsigned	i = rev_ptr_hash (c) & mask;
+    rev_run_pos	*p;
+
+    while ((p = &ci->table[i])->commit && p->commit != c)
+	i = (i + 1) & mask;
+    return p;
+}
+
+static rev_run_pos *
+rev_run_find (rev_commit_index *ci, rev_commit *c)
+{
+    rev_run_pos	*p;
+
+    if (!ci->tsize)
+	return NULL;
+    p = rev_run_slot (ci, c);
+    return p->commit ? p : NULL;
+}
+
+static void
+rev_run_insert (rev_commit_index *ci, rev_commit *c, int run, int pos)
+{
+    rev_run_pos	*old = ci->table, *p;
+    int		size = ci->tsize;
+    int		i;
+
+    if (ci->tcount * 2 >= ci->tsize) {
+	ci->tsize = size ? size * 2 : 1024;
+	ci->table = calloc (ci->tsize, sizeof (rev_run_pos));
+	for (i = 0; i < size; i++)
+	    if (old[i].commit)
+		*rev_run_slot (ci, old[i].commit) = old[i];
+	free (old);
+    }
+    p = rev_run_slot (ci, c);
+    p->commit = c;
+    p->run = run;
+    p->pos = pos;
+    ci->tcount++;
+}
+
+static long
+rev_match_bucket (time_t date)
+{
+    long    w = commit_time_window * 60L;
+    long    d = (long) date;
+
+    return d >= 0 ? d / w : -((-d + w - 1) / w);
+}
+
+static unsigned
+rev_match_hash (char *commitid, char *log, char *author, long bucket)
+{
+    return rev_ptr_hash (commitid) ^ (rev_ptr_hash (log) * 31) ^
+	   (rev_ptr_hash (author) * 131) ^ (unsigned) bucket * 2654435761u;
+}
+
+static rev_match *
+rev_match_find (rev_commit_index *ci, char *commitid, char *log,
+		char *author, long bucket, int create)
+{
+    rev_match	*m, **b;
+    int		i;
+
+    if (!ci->nhash) {
+	if (!create)
+	    return NULL;
+	ci->nhash = 1024;
+	ci->hash = calloc (ci->nhash, sizeof (rev_match *));
+    }
+    b = &ci->hash[rev_match_hash (commitid, log, author, bucket) &
+		  (ci->nhash - 1)];
+    for (m = *b; m; m = m->next)
+	if (m->commitid == commitid && m->log == log &&
+	    m->author == author && m->bucket == bucket)
+	    return m;
+    if (!create)
+	return NULL;
+    if (ci->nmatch == ci->nhash) {
+	rev_match   **hash = calloc (ci->nhash * 2, sizeof (rev_match *));
+	rev_match   *next;
+
+	for (i = 0; i < ci->nhash; i++)
+	    for (m = ci->hash[i]; m; m = next) {
+		next = m->next;
+		b = &hash[rev_match_hash (m->commitid, m->log, m->author,
+					  m->bucket) & (ci->nhash * 2 - 1)];
+		m->next = *b;
+		*b = m;
+	    }
+	free (ci->hash);
+	ci->hash = hash;
+	ci->nhash *= 2;
+	b = &ci->hash[rev_match_hash (commitid, log, author, bucket) &
+		      (ci->nhash - 1)];
+    }
+    m = calloc (1, sizeof (rev_match));
+    m->commitid = commitid;
+    m->log = log;
+    m->author = author;
+    m->bucket = bucket;
+    m->next = *b;
+    *b = m;
+    ci->nmatch++;
+    return m;
+}
+
+static void
+rev_match_add (rev_commit_index *ci, rev_commit *c, int run, int pos)
+{
+    rev_match	*m;
+
+    if (c->commitid)
+	m = rev_match_find (ci, c->commitid, NULL, NULL, 0, 1);
+    else if (commit_time_window > 0)
+	m = rev_match_find (ci, NULL, c->log, c->author,
+			    rev_match_bucket (c->date), 1);
+    else
+	return;
+    if (m->n == m->size) {
+	m->size = m->size ? m->size * 2 : 4;
+	m->run = realloc (m->run, m->size * sizeof (int));
+	m->pos = realloc (m->pos, m->size * sizeof (int));
+    }
+    m->run[m->n] = run;
+    m->pos[m->n] = pos;
+    m->n++;
+}
+
+/*
+ * Index the commits branch brings in, once it has been merged
+ */
+static void
+rev_commit_index_add (rev_commit_index *ci, rev_ref *branch)
+{
+    rev_run	*r;
+    rev_commit	*c;
+    int		n, i;
+
+    if (ci->nrun == ci->srun) {
+	ci->srun = ci->srun ? ci->srun * 2 : 64;
+	ci->runs = realloc (ci->runs, ci->srun * sizeof (rev_run));
+    }
+    r = &ci->runs[ci->nrun];
+    memset (r, 0, sizeof (*r));
+    r->head = branch;
+    n = 0;
+    for (c = branch->commit; c && !rev_run_find (ci, c); c = c->parent)
+	n++;
+    r->commits = calloc (n + 1, sizeof (rev_commit *));
+    for (r->size = 1; r->size < n; r->size <<= 1)
+	;
+    r->dates = calloc (2 * r->size, sizeof (time_t));
+    for (i = 0, c = branch->commit; i < n; i++, c = c->parent) {
+	r->commits[i] = c;
+	r->dates[r->size + i] = c->date;
+	rev_run_insert (ci, c, ci->nrun, i);
+	rev_match_add (ci, c, ci->nrun, i);
+    }
+    r->ncommit = n;
+    for (i = n; i < r->size; i++)
+	r->dates[r->size + i] = (time_t) LONG_MAX;
+    for (i = r->size - 1; i > 0; i--)
+	r->dates[i] = (long) r->dates[2 * i] <= (long) r->dates[2 * i + 1] ?
+		      r->dates[2 * i] : r->dates[2 * i + 1];
+    ci->nrun++;
+}
+
+static void
+rev_commit_index_free (rev_commit_index *ci)
+{
+    rev_match	*m, *next;
+    int		i;
+
+    for (i = 0; i < ci->nrun; i++) {
+	free (ci->runs[i].commits);
+	free (ci->runs[i].dates);
+    }
+    for (i = 0; i < ci->nhash; i++)
+	for (m = ci->hash[i]; m; m = next) {
+	    next = m->next;
+	    free (m->run);
+	    free (m->pos);
+	    free (m);
+	}
+    free (ci->runs);
+    free (ci->table);
+    free (ci->hash);
+    memset (ci, 0, sizeof (*ci));
+}
+
+/*
+ * First entry of m at or after pos in run matching file, or -1
+ */
+static int
+rev_match_first (rev_commit_index *ci, rev_match *m, int run, int pos,
+		 rev_commit *file)
+{
+    int	lo = 0, hi = m->n, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (m->run[mid] < run || (m->run[mid] == run && m->pos[mid] < pos))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (; lo < m->n && m->run[lo] == run; lo++)
+	if (file->commitid ||
+	    commit_time_close (ci->runs[run].commits[m->pos[lo]]->date,
+			       file->date))
+	    return m->pos[lo];
+    return -1;
+}
+
+/*
+ * First commit from pos in run which rev_commit_match pairs with
+ * file, or -1
+ */
+static int
+rev_run_match (rev_commit_index *ci, int run, int pos, rev_commit *file)
+{
+    rev_match	*m;
+    long	b;
+    int		best = -1, i, p;
+
+    if (file->commitid) {
+	m = rev_match_find (ci, file->commitid, NULL, NULL, 0, 0);
+	return m ? rev_match_first (ci, m, run, pos, file) : -1;
+    }
+    if (commit_time_window <= 0)
+	return -1;
+    b = rev_match_bucket (file->date);
+    for (i = -1; i <= 1; i++) {
+	m = rev_match_find (ci, NULL, file->log, file->author, b + i, 0);
+	if (!m)
+	    continue;
+	p = rev_match_first (ci, m, run, pos, file);
+	if (p >= 0 && (best < 0 || p < best))
+	    best = p;
+    }
+    return best;
+}
+
+/*
+ * First commit from pos in run dated at or before date, or -1
+ */
+static int
+rev_run_date (rev_run *r, int pos, time_t date)
+{
+    int	i = r->size + pos;
+
+    if (pos >= r->ncommit)
+	return -1;
+    for (;;) {
+	if ((long) r->dates[i] <= (long) date) {
+	    while (i < r->size) {
+		i *= 2;
+		if ((long) r->dates[i] > (long) date)
+		    i++;
+	    }
+	    return i - r->size < r->ncommit ? i - r->size : -1;
+	}
+	while (i & 1)
+	    i >>= 1;
+	if (!i)
+	    return -1;
+	i++;
+    }
+}
+
 static rev_commit *
 rev_commit_locate_date (rev_ref *branch, time_t date)
 {
-    rev_commit	*commit;
-
-    for (commit = branch->commit; commit; commit = commit->parent)
+    rev_commit_index	*ci = &commit_index;
+    rev_commit		*commit = branch->commit;
+    rev_run_pos		*p;
+    rev_run		*r;
+    int			i;
+
+    while (commit && (p = rev_run_find (ci, commit))) {
+	r = &ci->runs[p->run];
+	i = rev_run_date (r, p->pos, date);
+	if (i >= 0)
+	    return r->commits[i];
+	commit = r->commits[r->ncommit - 1]->parent;
+    }
+    /* history not yet indexed */
+    for (; commit; commit = commit->parent)
     {
 	if (time_compare (commit->date, date) <= 0)
 	    return commit;
@@ -507,14 +1064,24 @@ rev_commit_locate_date (rev_ref *branch, time_t date)
 static rev_commit *
 rev_commit_locate_one (rev_ref *branch, rev_commit *file)
 {
-    rev_commit	*commit;
+    rev_commit_index	*ci = &commit_index;
+    rev_commit		*commit;
+    rev_run_pos		*p;
+    rev_run		*r;
+    int			i;
 
     if (!branch)
 	return NULL;
 
-    for (commit = branch->commit;
-	 commit;
-	 commit = commit->parent)
+    commit = branch->commit;
+    while (commit && (p = rev_run_find (ci, commit))) {
+	r = &ci->runs[p->run];
+	i = rev_run_match (ci, p->run, p->pos, file);
+	if (i >= 0)
+	    return r->commits[i];
+	commit = r->commits[r->ncommit - 1]->parent;
+    }
+    for (; commit; commit = commit->parent)
     {
 	if (rev_commit_match (commit, file))
 	    return commit;
@@ -522,17 +1089,27 @@ rev_commit_locate_one (rev_ref *branch, rev_commit *file)
     return NULL;
 }
 
+/*
+ * The match along the last of branch and the heads after it which
+ * has one
+ */
 static rev_commit *
 rev_commit_locate_any (rev_ref *branch, rev_commit *file)
 {
-    rev_commit	*commit;
-
-    if (!branch)
-	return NULL;
-    commit = rev_commit_locate_any (branch->next, file);
-    if (commit)
-	return commit;
-    return rev_commit_locate_one (branch, file);
+    rev_ref	**heads;
+    rev_ref	*h;
+    rev_commit	*commit = NULL;
+    int		n = 0;
+
+    for (h = branch; h; h = h->next)
+	n++;
+    heads = calloc (n + 1, sizeof (rev_ref *));
+    for (h = branch, n = 0; h; h = h->next)
+	heads[n++] = h;
+    while (n-- > 0 && !commit)
+	commit = rev_commit_locate_one (heads[n], file);
+    free (heads);
+    return commit;
 }
 
 static rev_commit *
@@ -554,24 +1131,39 @@ rev_commit_locate (rev_ref *branch, rev_commit *file)
     return rev_commit_locate_any (branch, file);
 }
 
+/*
+ * The first head, in list order, whose own commits hold a match.
+ * Each head's own commits are the run it added to the index.
+ */
 rev_ref *
 rev_branch_of_commit (rev_list *rl, rev_commit *commit)
 {
-    rev_ref	*h;
-    rev_commit	*c;
-
-    for (h = rl->heads; h; h = h->next)
-    {
-	if (h->tail)
-	    continue;
-	for (c = h->commit; c; c = c->parent) {
-	    if (rev_commit_match (c, commit))
-		return h;
-	    if (c->tail)
+    rev_commit_index	*ci = &commit_index;
+    rev_match		*m;
+    long		b;
+    int			best = -1, i, j;
+
+    if (commit->commitid) {
+	m = rev_match_find (ci, commit->commitid, NULL, NULL, 0, 0);
+	for (j = 0; m && j < m->n; j++)
+	    if (!ci->runs[m->run[j]].head->tail)
+		return ci->runs[m->run[j]].head;
+	return NULL;
+    }
+    if (commit_time_window <= 0)
+	return NULL;
+    b = rev_match_bucket (commit->date);
+    for (i = -1; i <= 1; i++) {
+	m = rev_match_find (ci, NULL, commit->log, commit->author, b + i, 0);
+	for (j = 0; m && j < m->n && (best < 0 || m->run[j] < best); j++)
+	    if (!ci->runs[m->run[j]].head->tail &&
+		commit_time_close (ci->runs[m->run[j]].commits[m->pos[j]]->date,
+				   commit->date)) {
+		best = m->run[j];
 		break;
-	}
+	    }
     }
-    return NULL;
+    return best < 0 ? NULL : ci->runs[best].head;
 }
 
 /*
@@ -585,6 +1177,205 @@ rev_commit_first_date (rev_commit *commit)
     return commit->date;
 }
 
+/*
+ * Branch cursors still walking back in rev_branch_merge. They sit in
+ * a heap ordered newest first, which hands out the leader of each
+ * step, and in groups of cursors sharing what rev_commit_match looks
+ * at (commitid, or else log and author), so the cursors to advance
+ * with the leader are found without visiting every file.
+ */
+typedef struct _rev_group {
+    struct _rev_group	*next;
+    char		*commitid;
+    char		*log;
+    char		*author;
+    int			first;
+} rev_group;
+
+typedef struct _rev_merge {
+    rev_commit	**commits;
+    int		*heap;
+    int		nheap;
+    int		*pos;		/* where each cursor is in the heap */
+    rev_group	**group;	/* and its group */
+    int		*gnext, *gprev;
+    rev_group	**hash;
+    int		nhash;
+    int		ngroup;
+    int		live;		/* cursors with something left to merge */
+} rev_merge;
+
+static int
+rev_merge_before (rev_merge *m, int a, int b)
+{
+    long    t = time_compare (m->commits[a]->date, m->commits[b]->date);
+
+    /* the original scan kept the first of equally new cursors */
+    return t > 0 || (t == 0 && a < b);
+}
+
+static void
+rev_merge_place (rev_merge *m, int i, int n)
+{
+    m->heap[i] = n;
+    m->pos[n] = i;
+}
+
+static void
+rev_merge_sift (rev_merge *m, int i)
+{
+    int	n = m->heap[i];
+    int	child;
+
+    while (i > 0 && rev_merge_before (m, n, m->heap[(i - 1) / 2])) {
+	rev_merge_place (m, i, m->heap[(i - 1) / 2]);
+	i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < m->nheap) {
+	if (child + 1 < m->nheap &&
+	    rev_merge_before (m, m->heap[child + 1], m->heap[child]))
+	    child++;
+	if (!rev_merge_before (m, m->heap[child], n))
+	    break;
+	rev_merge_place (m, i, m->heap[child]);
+	i = child;
+    }
+    rev_merge_place (m, i, n);
+}
+
+static unsigned
+rev_group_hash (char *commitid, char *log, char *author)
+{
+    uintptr_t	h = (uintptr_t) commitid ^ ((uintptr_t) log >> 3) ^
+		    ((uintptr_t) author << 5);
+
+    return (unsigned) (h ^ (h >> 11) ^ (h >> 23));
+}
+
+static rev_group *
+rev_group_find (rev_merge *m, rev_commit *c)
+{
+    char	*commitid = c->commitid;
+    char	*log = commitid ? NULL : c->log;
+    char	*author = commitid ? NULL : c->author;
+    rev_group	*g, **bucket;
+    int		i;
+
+    bucket = &m->hash[rev_group_hash (commitid, log, author) & (m->nhash - 1)];
+    for (g = *bucket; g; g = g->next)
+	if (g->commitid == commitid && g->log == log && g->author == author)
+	    return g;
+    if (m->ngroup == m->nhash) {
+	rev_group   **hash = calloc (m->nhash * 2, sizeof (rev_group *));
+	rev_group   *next;
+
+	for (i = 0; i < m->nhash; i++)
+	    for (g = m->hash[i]; g; g = next) {
+		next = g->next;
+		bucket = &hash[rev_group_hash (g->commitid, g->log, g->author) &
+			       (m->nhash * 2 - 1)];
+		g->next = *bucket;
+		*bucket = g;
+	    }
+	free (m->hash);
+	m->hash = hash;
+	m->nhash *= 2;
+	bucket = &m->hash[rev_group_hash (commitid, log, author) & (m->nhash - 1)];
+    }
+    g = calloc (1, sizeof (rev_group));
+    g->commitid = commitid;
+    g->log = log;
+    g->author = author;
+    g->first = -1;
+    g->next = *bucket;
+    *bucket = g;
+    m->ngroup++;
+    return g;
+}
+
+static void
+rev_merge_add (rev_merge *m, int n)
+{
+    rev_commit	*c = m->commits[n];
+    rev_group	*g = rev_group_find (m, c);
+
+    m->heap[m->nheap] = n;
+    m->pos[n] = m->nheap++;
+    rev_merge_sift (m, m->pos[n]);
+    m->group[n] = g;
+    m->gprev[n] = -1;
+    m->gnext[n] = g->first;
+    if (g->first >= 0)
+	m->gprev[g->first] = n;
+    g->first = n;
+    if (c->parent || c->file)
+	m->live++;
+}
+
+static void
+rev_merge_remove (rev_merge *m, int n)
+{
+    rev_commit	*c = m->commits[n];
+    int		i = m->pos[n];
+
+    if (--m->nheap != i) {
+	rev_merge_place (m, i, m->heap[m->nheap]);
+	rev_merge_sift (m, i);
+    }
+    if (m->gprev[n] >= 0)
+	m->gnext[m->gprev[n]] = m->gnext[n];
+    else
+	m->group[n]->first = m->gnext[n];
+    if (m->gnext[n] >= 0)
+	m->gprev[m->gnext[n]] = m->gprev[n];
+    if (c->parent || c->file)
+	m->live--;
+}
+
+static void
+rev_merge_init (rev_merge *m, rev_commit **commits, int nbranch)
+{
+    int	n;
+
+    memset (m, 0, sizeof (*m));
+    m->commits = commits;
+    m->heap = calloc (nbranch + 1, sizeof (int));
+    m->pos = calloc (nbranch + 1, sizeof (int));
+    m->gnext = calloc (nbranch + 1, sizeof (int));
+    m->gprev = calloc (nbranch + 1, sizeof (int));
+    m->group = calloc (nbranch + 1, sizeof (rev_group *));
+    m->nhash = 64;
+    m->hash = calloc (m->nhash, sizeof (rev_group *));
+    for (n = 0; n < nbranch; n++)
+	if (commits[n] && !commits[n]->tailed)
+	    rev_merge_add (m, n);
+}
+
+static void
+rev_merge_fini (rev_merge *m)
+{
+    rev_group	*g, *next;
+    int		i;
+
+    for (i = 0; i < m->nhash; i++)
+	for (g = m->hash[i]; g; g = next) {
+	    next = g->next;
+	    free (g);
+	}
+    free (m->hash);
+    free (m->heap);
+    free (m->pos);
+    free (m->gnext);
+    free (m->gprev);
+    free (m->group);
+}
+
+static int
+rev_merge_index_compare (const void *a, const void *b)
+{
+    return *(int *) a - *(int *) b;
+}
+
 /*
  * Merge a set of per-file branches into a global branch
  */
@@ -602,6 +1393,9 @@ rev_branch_merge (rev_ref **branches, int nbranch,
 	rev_commit **p;
 	int lazy = 0;
 	time_t start = 0;
+	rev_merge merge;
+	int *step = calloc (nbranch + 1, sizeof (int));
+	int nstep, i;
 
 	nlive = 0;
 	for (n = 0; n < nbranch; n++) {
@@ -647,18 +1441,11 @@ rev_branch_merge (rev_ref **branches, int nbranch,
 	 * Walk down branches until each one has merged with the
 	 * parent branch
 	 */
+	rev_merge_init (&merge, commits, nbranch);
 	while (nlive > 0 && nbranch > 0) {
-		for (n = 0, p = commits, latest = NULL; n < nbranch; n++) {
-			rev_commit *c = commits[n];
-			if (!c)
-				continue;
-			*p++ = c;
-			if (c->tailed)
-				continue;
-			if (!latest || time_compare(latest->date, c->date) < 0)
-				latest = c;
-		}
-		nbranch = p - commits;
+		rev_group *g;
+
+		latest = commits[merge.heap[0]];
 
 		/*
 		 * Construct current commit
@@ -672,21 +1459,23 @@ rev_branch_merge (rev_ref **branches, int nbranch,
 		}
 
 		/*
-		 * Step each branch
+		 * Step each branch matching the leader, in the order
+		 * the files were given
 		 */
-		nlive = 0;
-		for (n = 0; n < nbranch; n++) {
-			rev_commit *c = commits[n];
+		g = merge.group[merge.heap[0]];
+		nstep = 0;
+		for (n = g->first; n >= 0; n = merge.gnext[n])
+			if (commits[n] == latest ||
+			    rev_commit_match(commits[n], latest))
+				step[nstep++] = n;
+		qsort (step, nstep, sizeof (int), rev_merge_index_compare);
+		for (i = 0; i < nstep; i++) {
+			rev_commit *c;
 			rev_commit *to;
-			/* already got to parent branch? */
-			if (c->tailed)
-				continue;
-			/* not affected? */
-			if (c != latest && !rev_commit_match(c, latest)) {
-				if (c->parent || c->file)
-					nlive++;
-				continue;
-			}
+
+			n = step[i];
+			c = commits[n];
+			rev_merge_remove (&merge, n);
 			to = c->parent;
 			/* starts here? */
 			if (!to)
@@ -715,9 +1504,7 @@ rev_branch_merge (rev_ref **branches, int nbranch,
 				 * our branch's creation.
 				 */
 				to->tailed = 1;
-			} else if (to->file) {
-				nlive++;
-			} else {
+			} else if (!to->file) {
 				/*
 				 * See if it's recent CVS adding a file
 				 * independently added on another branch.
@@ -726,23 +1513,31 @@ rev_branch_merge (rev_ref **branches, int nbranch,
 					goto Kill;
 				if (to->tail && to->date == to->parent->date)
 					goto Kill;
-				nlive++;
 			}
 			if (to->file)
 				set_commit(to);
 			else
 				delete_commit(c);
 			commits[n] = to;
+			if (!to->tailed)
+				rev_merge_add (&merge, n);
 			continue;
 Kill:
 			delete_commit(c);
 			commits[n] = NULL;
 		}
+		nlive = merge.live;
 
 		*tail = commit;
 		tail = &commit->parent;
 		prev = commit;
 	}
+	rev_merge_fini (&merge);
+	free (step);
+	for (n = 0, p = commits; n < nbranch; n++)
+		if (commits[n])
+			*p++ = commits[n];
+	nbranch = p - commits;
     /*
      * Connect to parent branch
      */
@@ -816,56 +1611,52 @@ Kill:
     branch->commit = head;
 }
 
+/*
+ * The commit a tag's sorted array would start with, found by one
+ * pass over the chunks it was recorded in
+ */
+static rev_commit *
+rev_tag_newest(Tag *tag)
+{
+	Chunk *chunk;
+	rev_commit *newest = NULL;
+	int n, first = 1;
+
+	for (chunk = tag->commits, n = tag->left; chunk;
+	     chunk = chunk->next, n = 0) {
+		for (; n < Ncommits; n++) {
+			if (first || rev_commit_date_compare(&chunk->v[n],
+							     &newest) < 0)
+				newest = chunk->v[n];
+			first = 0;
+		}
+	}
+	return newest;
+}
+
 /*
  * Locate position in tree cooresponding to specific tag
  */
 static void
-rev_tag_search(Tag *tag, rev_commit **commits, rev_list *rl)
+rev_tag_search(Tag *tag, rev_list *rl)
 {
-	rev_commit_date_sort(commits, tag->count);
-	tag->parent = rev_branch_of_commit(rl, commits[0]);
+	rev_commit *newest = rev_tag_newest(tag);
+	rev_commit **commits;
+
+	tag->parent = rev_branch_of_commit(rl, newest);
 	if (tag->parent)
-		tag->commit = rev_commit_locate (tag->parent, commits[0]);
+		tag->commit = rev_commit_locate (tag->parent, newest);
 	if (!tag->commit) {
 		fprintf (stderr, "unmatched tag %s\n", tag->name);
 		/* AV: shouldn't we put it on some branch? */
+		commits = tagged(tag);
+		rev_commit_date_sort(commits, tag->count);
 		tag->commit = rev_commit_build(commits, commits[0], tag->count);
+		free(commits);
 	}
 	tag->commit->tagged = 1;
 }
 
-static void
-rev_ref_set_parent (rev_list *rl, rev_ref *dest, rev_list *source)
-{
-    rev_ref	*sh;
-    rev_list	*s;
-    rev_ref	*p;
-    rev_ref	*max;
-
-    if (dest->depth)
-	return;
-
-    max = NULL;
-    for (s = source; s; s = s->next) {
-	sh = rev_find_head (s, dest->name);
-	if (!sh)
-	    continue;
-	if (!sh->parent)
-	    continue;
-	p = rev_find_head (rl, sh->parent->name);
-	assert (p);
-	rev_ref_set_parent (rl, p, source);
-	if (!max || p->depth > max->depth)
-	    max = p;
-    }
-    dest->parent = max;
-    if (max)
-	dest->depth = max->depth + 1;
-    else
-	dest->depth = 1;
-}
-
-
 #if UNUSED
 static void
 rev_head_find_parent (rev_list *rl, rev_ref *h, rev_list *lhead)
@@ -941,78 +1732,70 @@ rev_ref_parent (rev_ref **refs, int nref, rev_list *rl)
 rev_list *
 rev_list_merge (rev_list *head)
 {
-    int		count = rev_list_count (head);
     rev_list	*rl = calloc (1, sizeof (rev_list));
     rev_list	*l;
     rev_ref	*lh, *h;
+    rev_ref	**tail = &rl->heads;
     Tag		*t;
-    rev_ref	**refs = calloc (count, sizeof (rev_ref *));
-    int		nref;
+    rev_name_index  ix = { NULL, 0, 0 };
+    rev_name_entry  *e;
 
     /*
-     * Find all of the heads across all of the incoming trees
-     * Yes, this is currently very inefficient
+     * Find all of the heads across all of the incoming trees,
+     * noting where each one appears
      */
     for (l = head; l; l = l->next) {
 	for (lh = l->heads; lh; lh = lh->next) {
-	    h = rev_find_head (rl, lh->name);
-	    if (!h)
-		rev_list_add_head (rl, NULL, lh->name, lh->degree);
-	    else if (lh->degree > h->degree)
+	    e = rev_name_insert (&ix, lh->name);
+	    if (!e->head) {
+		h = calloc (1, sizeof (rev_ref));
+		h->name = lh->name;
 		h->degree = lh->degree;
+		*tail = h;
+		tail = &h->next;
+		e->head = h;
+	    } else if (lh->degree > e->head->degree)
+		e->head->degree = lh->degree;
+	    rev_name_add_ref (e, lh);
 	}
     }
     /*
-     * Sort by degree so that finding branch points always works
+     * Sort parents before branches so that finding branch points
+     * always works, and find branch parent relationships
      */
 //    rl->heads = rev_ref_sel_sort (rl->heads);
-    rl->heads = rev_ref_tsort (rl->heads, head);
-    if (!rl->heads)
+    rl->heads = rev_ref_tsort (rl->heads, &ix);
+    if (!rl->heads) {
+	rev_name_index_free (&ix);
 	return NULL;
+    }
 //    for (h = rl->heads; h; h = h->next)
 //	fprintf (stderr, "head %s (%d)\n",
 //		 h->name, h->degree);
-    /*
-     * Find branch parent relationships
-     */
-    for (h = rl->heads; h; h = h->next) {
-	rev_ref_set_parent (rl, h, head);
-//	dump_ref_name (stderr, h);
-//	fprintf (stderr, "\n");
-    }
     /*
      * Merge common branches
      */
     for (h = rl->heads; h; h = h->next) {
-	/*
-	 * Locate branch in every tree
-	 */
-	nref = 0;
-	for (l = head; l; l = l->next) {
-	    lh = rev_find_head (l, h->name);
-	    if (lh)
-		refs[nref++] = lh;
-	}
-	if (nref)
-	    rev_branch_merge (refs, nref, h, rl);
+	e = rev_name_find (&ix, h->name);
+	rev_branch_merge (e->refs, e->nref, h, rl);
+	rev_commit_index_add (&commit_index, h);
     }
     /*
      * Compute 'tail' values
      */
     rev_list_set_tail (rl);
 
-    free(refs);
+    rev_name_index_free (&ix);
     /*
      * Find tag locations
      */
     for (t = all_tags; t; t = t->next) {
-	rev_commit **commits = tagged(t);
-	if (commits)
-	    rev_tag_search(t, commits, rl);
+	if (t->count)
+	    rev_tag_search(t, rl);
 	else
 	    fprintf (stderr, "lost tag %s\n", t->name);
-	free(commits);
     }
+    rev_commit_index_free (&commit_index);
     rev_list_validate (rl);
     return rl;
 }
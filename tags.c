@@ -34,16 +34,15 @@ static Tag *find_tag(char *name)
 	return tag;
 }
 
-/* the last argument is a sham */
-void tag_commit(rev_commit *c, char *name)
+void tag_commit(rev_commit *c, char *name, char *file)
 {
 	Tag *tag = find_tag(name);
-	if (tag->last == this_file->name) {
+	if (tag->last == file) {
 		fprintf(stderr, "duplicate tag %s in %s, ignoring\n",
-			name, this_file->name);
+			name, file);
 		return;
 	}
-	tag->last = this_file->name;
+	tag->last = file;
 	if (!tag->left) {
 		Chunk *v = malloc(sizeof(Chunk));
 		v->next = tag->commits;
@@ -1,13 +1,11 @@
 #include "cvs.h"
 #include "cache.h"
-#include "cache-tree.h"
 
 typedef struct _entry {
 	char *cvs_name;
 	struct _entry *next;
 	char *name;
 	size_t len;
-	struct cache_entry *ce;
 } Hash_entry;
 
 static Hash_entry *table[4096];
@@ -90,70 +88,236 @@ static Hash_entry *find_node(rev_commit *c)
 	entry->name = xmalloc(len + 1);
 	memcpy(entry->name, real_name, len + 1);
 
-	entry->ce = xcalloc(1, cache_entry_size(len));
-	memcpy(entry->ce->name, real_name, len);
-	entry->ce->ce_flags = create_ce_flags(len, 0);
-
 	entry->next = table[hash];
 	table[hash] = entry;
 	return entry;
 }
 
-static int cache_broken;
+/*
+ * The files of the commit being built, as a tree of directories
+ * whose entries are kept in git's tree order. Changing an entry
+ * marks every directory above it dirty; writing the tree only has
+ * to format and store those, the rest keep the names they had.
+ * Objects go straight to the pack, which already knows which trees
+ * exist, so unchanged directories never reach the filesystem.
+ */
+typedef struct _tree_dir Tree_dir;
+
+typedef struct _tree_entry {
+	char *name;
+	size_t len;
+	unsigned mode;
+	unsigned char sha1[20];
+	Tree_dir *dir;		/* for directories */
+} Tree_entry;
+
+struct _tree_dir {
+	Tree_entry *entries;
+	int nentries, maxentries;
+	int dirty;
+	int written;		/* entries in the stored tree */
+	unsigned char sha1[20];
+};
+
+static Tree_dir root;
+static char *tree_buf;
+static size_t tree_size;
+
+/* Git sorts directories as if their names ended in '/' */
+static int entry_cmp(const char *name, size_t len, int isdir, Tree_entry *e)
+{
+	size_t n = len < e->len ? len : e->len;
+	int c = memcmp(name, e->name, n);
+	int a, b;
+
+	if (c)
+		return c;
+	a = n < len ? (unsigned char)name[n] : isdir ? '/' : 0;
+	b = n < e->len ? (unsigned char)e->name[n] : e->dir ? '/' : 0;
+	return a - b;
+}
 
-static void delete_file(Hash_entry *entry)
+/* Find NAME in D, or return where it would go as a negative number */
+static int dir_find(Tree_dir *d, const char *name, size_t len, int isdir)
 {
-	remove_file_from_cache(entry->name);
-	cache_tree_invalidate_path(active_cache_tree, entry->name);
+	int lo = 0, hi = d->nentries, mid, c;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		c = entry_cmp(name, len, isdir, &d->entries[mid]);
+		if (!c)
+			return mid;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -lo - 1;
 }
 
-static int set_file(Hash_entry *entry, rev_file *file)
+static Tree_entry *dir_insert(Tree_dir *d, int i, const char *name,
+			      size_t len)
 {
-	int options = ADD_CACHE_OK_TO_ADD | ADD_CACHE_OK_TO_REPLACE;
+	Tree_entry *e;
 
-	if (get_sha1_hex(file->sha1, entry->ce->sha1))
-		die("corrupt sha1: %s\n", file->sha1);
+	if (d->nentries == d->maxentries) {
+		d->maxentries = d->maxentries ? d->maxentries * 2 : 8;
+		d->entries = xrealloc(d->entries,
+				      d->maxentries * sizeof(Tree_entry));
+	}
+	memmove(d->entries + i + 1, d->entries + i,
+		(d->nentries - i) * sizeof(Tree_entry));
+	d->nentries++;
+	e = &d->entries[i];
+	memset(e, 0, sizeof(*e));
+	e->name = atom_n((char *)name, len);
+	e->len = len;
+	return e;
+}
+
+static void dir_free(Tree_dir *d)
+{
+	int i;
+
+	for (i = 0; i < d->nentries; i++)
+		if (d->entries[i].dir) {
+			dir_free(d->entries[i].dir);
+			free(d->entries[i].dir);
+		}
+	free(d->entries);
+	memset(d, 0, sizeof(*d));
+}
+
+/*
+ * Walk down to the directory holding PATH, marking the way dirty
+ * and, if CREATE is set, making directories that are missing
+ */
+static Tree_dir *path_dir(char *path, char **base, int create)
+{
+	Tree_dir *d = &root;
+	Tree_entry *e;
+	char *slash;
+	int i;
+
+	d->dirty = 1;
+	while ((slash = strchr(path, '/'))) {
+		i = dir_find(d, path, slash - path, 1);
+		if (i < 0) {
+			if (!create)
+				return NULL;
+			e = dir_insert(d, -i - 1, path, slash - path);
+			e->mode = 040000;
+			e->dir = xcalloc(1, sizeof(Tree_dir));
+		} else
+			e = &d->entries[i];
+		d = e->dir;
+		d->dirty = 1;
+		path = slash + 1;
+	}
+	*base = path;
+	return d;
+}
 
-	entry->ce->ce_mode = create_ce_mode(file->mode);
-	if (add_cache_entry(entry->ce, options))
-		return error("can't add %s\n", entry->name);
+static void delete_file(Hash_entry *entry)
+{
+	char *base;
+	Tree_dir *d = path_dir(entry->name, &base, 0);
+	int i;
 
-	cache_tree_invalidate_path(active_cache_tree, entry->name);
+	if (!d)
+		return;
+	i = dir_find(d, base, strlen(base), 0);
+	if (i < 0)
+		return;
+	memmove(d->entries + i, d->entries + i + 1,
+		(d->nentries - i - 1) * sizeof(Tree_entry));
+	d->nentries--;
+}
 
-	return 0;
+static void set_file(Hash_entry *entry, rev_file *file)
+{
+	char *base;
+	Tree_dir *d = path_dir(entry->name, &base, 1);
+	size_t len = strlen(base);
+	Tree_entry *e;
+	int i;
+
+	i = dir_find(d, base, len, 0);
+	e = i < 0 ? dir_insert(d, -i - 1, base, len) : &d->entries[i];
+	if (get_sha1_hex(file->sha1, e->sha1))
+		die("corrupt sha1: %s\n", file->sha1);
+	e->mode = (file->mode & 0100) ? 0100755 : 0100644;
 }
 
 void delete_commit(rev_commit *c)
 {
 	Hash_entry *entry = find_node(c);
-	if (entry && !cache_broken)
+	if (entry)
 		delete_file(entry);
 }
 
 void set_commit(rev_commit *c)
 {
-	if (!cache_broken) {
-		Hash_entry *entry = find_node(c);
-		if (entry)
-			cache_broken = set_file(entry, c->file);
-	}
+	Hash_entry *entry = find_node(c);
+	if (entry)
+		set_file(entry, c->file);
 }
 
 void reset_commits(rev_commit **commits, int ncommits)
 {
-	discard_cache();
-	active_cache_tree = cache_tree();
-	cache_broken = 0;
-	while (ncommits-- && !cache_broken) {
+	dir_free(&root);
+	root.dirty = 1;
+	while (ncommits--) {
 		rev_commit *c = *commits++;
 		if (c) {
 			Hash_entry *entry = find_node(c);
 			if (entry)
-				cache_broken = set_file(entry, c->file);
+				set_file(entry, c->file);
 		}
 	}
 }
 
+/*
+ * Store the dirty directories below D, then D itself. Directories
+ * left empty are dropped from their parents, as git has no place
+ * for them.
+ */
+static void write_dir(Tree_dir *d)
+{
+	Tree_entry *e;
+	size_t len = 0, need;
+	int i;
+
+	if (!d->dirty)
+		return;
+	for (i = 0; i < d->nentries; i++)
+		if (d->entries[i].dir)
+			write_dir(d->entries[i].dir);
+	d->written = 0;
+	for (i = 0; i < d->nentries; i++) {
+		e = &d->entries[i];
+		if (e->dir) {
+			if (!e->dir->written)
+				continue;
+			memcpy(e->sha1, e->dir->sha1, 20);
+		}
+		need = len + e->len + 30;
+		if (need > tree_size) {
+			tree_size = tree_size ? tree_size * 2 : 8192;
+			if (tree_size < need)
+				tree_size = need;
+			tree_buf = xrealloc(tree_buf, tree_size);
+		}
+		len += sprintf(tree_buf + len, "%o %s", e->mode, e->name) + 1;
+		memcpy(tree_buf + len, e->sha1, 20);
+		len += 20;
+		d->written++;
+	}
+	if (d->written || d == &root)
+		pack_sha1_file(tree_buf, len, "tree", d->sha1);
+	d->dirty = 0;
+}
+
 rev_commit *create_tree(rev_commit *leader)
 {
 	rev_commit *commit = xcalloc(1, sizeof (rev_commit));
@@ -163,14 +327,8 @@ rev_commit *create_tree(rev_commit *leader)
 	commit->log = leader->log;
 	commit->author = leader->author;
 
-	if (!cache_broken) {
-		if (cache_tree_update(active_cache_tree, active_cache,
-				      active_nr, 0, 0))
-			cache_broken = error("writing tree");
-	}
-
-	if (!cache_broken)
-		commit->sha1 = atom(sha1_to_hex(active_cache_tree->sha1));
+	write_dir(&root);
+	commit->sha1 = atom(sha1_to_hex(root.sha1));
 
 	return commit;
 }
@@ -184,12 +342,14 @@ void init_tree(int n)
 void discard_tree(void)
 {
 	int i;
-	discard_cache();
+	dir_free(&root);
+	free(tree_buf);
+	tree_buf = NULL;
+	tree_size = 0;
 	for (i = 0; i < 4096; i++) {
 		Hash_entry *entry = table[i];
 		while (entry) {
 			Hash_entry *next = entry->next;
-			free(entry->ce);
 			free(entry->name);
 			free(entry);
 			entry = next;